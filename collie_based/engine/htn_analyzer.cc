@@ -0,0 +1,230 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+// Offline analyzer of --results logs: per-QP rates, Jain's fairness index,
+// the bias score of python_based/analyzer.py and anomaly flags.
+// Usage: htn_analyzer [--line_rate=100] file...
+// Exits 1 if any file is flagged.
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "htn_results.hh"
+
+DEFINE_double(line_rate, 100, "Line rate in Gbps the bias score is computed against");
+DEFINE_double(score_threshold, 0.8, "Flag LOW_SCORE below this bias score");
+DEFINE_double(jain_threshold, 0.9, "Flag UNFAIR below this Jain index");
+DEFINE_double(cv_threshold, 0.1, "Flag UNSTABLE above this coefficient of variation of the total rate");
+DEFINE_bool(per_qp, true, "Print one line per QP");
+
+using namespace Htn;
+
+struct qp_total {
+    uint64_t bytes = 0;
+    uint64_t msgs = 0;
+    uint64_t errors = 0;
+    uint64_t duration = 0;
+    uint64_t starved = 0;  // intervals without traffic while others moved
+    double Gbps() const { return duration ? bytes * 8.0 / duration / 1000.0 : 0; }
+    double Mrps() const { return duration ? msgs * 1.0 / duration : 0; }
+};
+
+// (sum x)^2 / (n * sum x^2), 1 when all are equal, 1/n when one takes all
+static double Jain(const std::vector<double> &x) {
+    double sum = 0, sq = 0;
+    for (auto v : x) {
+        sum += v;
+        sq += v * v;
+    }
+    return sq > 0 ? sum * sum / (x.size() * sq) : 1;
+}
+
+// analyzer.calculate_throughput(): every QP below its share of the line rate
+// lowers the score by its relative shortfall / n.
+static double BiasScore(const std::vector<double> &gbps, double line_rate) {
+    double expected = line_rate / gbps.size();
+    double bias = 0;
+    for (auto v : gbps) {
+        if (v < expected) {
+            bias += (expected - v) / gbps.size() / expected;
+        }
+    }
+    return 1 - bias;
+}
+
+static double Cv(const std::vector<double> &x) {
+    if (x.empty()) {
+        return 0;
+    }
+    double mean = 0, var = 0;
+    for (auto v : x) {
+        mean += v;
+    }
+    mean /= x.size();
+    for (auto v : x) {
+        var += (v - mean) * (v - mean);
+    }
+    return mean > 0 ? std::sqrt(var / x.size()) / mean : 0;
+}
+
+static int Analyze(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || st.st_size < (off_t)sizeof(results_header)) {
+        fprintf(stderr, "%s: cannot open results log\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    auto header = (const results_header *)base;
+    size_t meta = (sizeof(results_header) + header->qp_num * sizeof(results_qp) + 7) & ~(size_t)7;
+    if (header->magic != kResultsMagic || header->version != kResultsVersion ||
+        header->header_size != sizeof(results_header) ||
+        header->record_size != sizeof(results_record) ||
+        meta + header->capacity * sizeof(results_record) > (size_t)st.st_size) {
+        fprintf(stderr, "%s: not a version %u results log\n", path, kResultsVersion);
+        munmap(base, st.st_size);
+        return -1;
+    }
+    auto qps = (const results_qp *)(header + 1);
+    auto ring = (const results_record *)((const char *)base + meta);
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t count = std::min(head, header->capacity);
+    uint64_t first = head - count;
+
+    // Only the measurement window if the run had one.
+    bool measured = false;
+    for (uint64_t i = first; i < head; i++) {
+        measured |= ring[i % header->capacity].phase == 1;
+    }
+    std::map<uint32_t, qp_total> totals;
+    for (uint32_t q = 0; q < header->qp_num; q++) {
+        totals[qps[q].id];
+    }
+    std::vector<double> interval_gbps, interval_jain;
+    uint64_t errors = 0, starved = 0;
+    // Records of one interval share their timestamp.
+    for (uint64_t i = first; i < head;) {
+        uint64_t end = i;
+        auto ts = ring[i % header->capacity].timestamp;
+        while (end < head && ring[end % header->capacity].timestamp == ts) {
+            end++;
+        }
+        auto &r0 = ring[i % header->capacity];
+        if (measured && r0.phase != 1) {
+            i = end;
+            continue;
+        }
+        double total = 0;
+        bool moving = false;
+        std::vector<double> rates;
+        for (uint64_t j = i; j < end; j++) {
+            auto &r = ring[j % header->capacity];
+            // A receiver log only has receive counters.
+            uint64_t bytes = r.bytes ? r.bytes : r.recv_bytes;
+            moving |= bytes > 0;
+            rates.push_back(r.duration ? bytes * 8.0 / r.duration / 1000.0 : 0);
+            total += rates.back();
+        }
+        for (uint64_t j = i; j < end; j++) {
+            auto &r = ring[j % header->capacity];
+            auto &t = totals[r.qp];
+            t.bytes += r.bytes ? r.bytes : r.recv_bytes;
+            t.msgs += r.msgs ? r.msgs : r.recv_msgs;
+            t.errors += r.errors;
+            t.duration += r.duration;
+            if (moving && r.bytes == 0 && r.recv_bytes == 0) {
+                t.starved++;
+                starved++;
+            }
+            errors += r.errors;
+        }
+        interval_gbps.push_back(total);
+        interval_jain.push_back(Jain(rates));
+        i = end;
+    }
+
+    std::vector<double> gbps;
+    double total_gbps = 0, total_mrps = 0;
+    for (auto &kv : totals) {
+        auto &t = kv.second;
+        gbps.push_back(t.Gbps());
+        total_gbps += t.Gbps();
+        total_mrps += t.Mrps();
+        if (FLAGS_per_qp) {
+            printf("qp %u Rate=%.3f Gbps, %.3f Mrps, errors %lu, starved intervals %lu\n",
+                   kv.first, t.Gbps(), t.Mrps(), t.errors, t.starved);
+        }
+    }
+    double jain = gbps.empty() ? 1 : Jain(gbps);
+    double score = gbps.empty() ? 0 : BiasScore(gbps, FLAGS_line_rate);
+    double cv = Cv(interval_gbps);
+    double min_jain = interval_jain.empty() ? 1 : *std::min_element(interval_jain.begin(), interval_jain.end());
+    std::string flags;
+    if (score < FLAGS_score_threshold) {
+        flags += "LOW_SCORE,";
+    }
+    if (jain < FLAGS_jain_threshold) {
+        flags += "UNFAIR,";
+    }
+    if (starved) {
+        flags += "STARVED,";
+    }
+    if (errors) {
+        flags += "ERRORS,";
+    }
+    if (cv > FLAGS_cv_threshold) {
+        flags += "UNSTABLE,";
+    }
+    if (head > header->capacity) {
+        flags += "WRAPPED,";  // the start of the run was overwritten
+    }
+    if (!flags.empty()) {
+        flags.pop_back();
+    }
+    printf("ANALYSIS file=%s host=%s dev=%s qp_num=%u intervals=%zu gbps=%.3f mrps=%.3f "
+           "jain=%.4f min_interval_jain=%.4f score=%.4f cv=%.4f errors=%lu flags=%s\n",
+           path, header->host, header->dev, header->qp_num, interval_gbps.size(), total_gbps,
+           total_mrps, jain, min_jain, score, cv, errors, flags.empty() ? "none" : flags.c_str());
+    munmap(base, st.st_size);
+    // WRAPPED alone is not an anomaly.
+    return flags.empty() || flags == "WRAPPED" ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    gflags::SetUsageMessage("htn_analyzer [flags] results_file...");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc < 2) {
+        fprintf(stderr, "usage: htn_analyzer [flags] results_file...\n");
+        return 2;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        int r = Analyze(argv[i]);
+        if (r < 0) {
+            return 2;
+        }
+        ret |= r;
+    }
+    return ret;
+}
@@ -0,0 +1,249 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "htn_cc.hh"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <mutex>
+#include <net/if.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace Htn {
+
+static int Ethtool(int sock, const std::string &netdev, void *cmd) {
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, netdev.c_str(), IFNAMSIZ - 1);
+    ifr.ifr_data = (char *)cmd;
+    return ioctl(sock, SIOCETHTOOL, &ifr);
+}
+
+std::string NetdevOf(const std::string &dev, int port_num) {
+    // The netdev behind the GID in use, else the first one of the device.
+    std::ifstream ndev("/sys/class/infiniband/" + dev + "/ports/" +
+                       std::to_string(port_num) + "/gid_attrs/ndevs/" +
+                       std::to_string(FLAGS_gid));
+    std::string name;
+    if (ndev >> name) {
+        return name;
+    }
+    DIR *dir = opendir(("/sys/class/infiniband/" + dev + "/device/net").c_str());
+    if (!dir) {
+        return "";
+    }
+    while (auto entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            name = entry->d_name;
+            break;
+        }
+    }
+    closedir(dir);
+    return name;
+}
+
+htn_cc_counters::~htn_cc_counters() {
+    for (auto &counter : port_) {
+        close(counter.fd);
+    }
+    if (sock_ >= 0) {
+        close(sock_);
+    }
+}
+
+int htn_cc_counters::Open(const std::string &dev, int port_num) {
+    OpenPortCounters(dev, port_num, FLAGS_cc_counters, &port_);
+    for (auto &counter : port_) {
+        names_.push_back(counter.name);
+    }
+    totals_.assign(port_.size(), 0);
+    netdev_ = NetdevOf(dev, port_num);
+    auto patterns = ParseHost(FLAGS_cc_ethtool);
+    if (!netdev_.empty() && !FLAGS_cc_ethtool.empty() && OpenEthtool(patterns)) {
+        LOG(WARNING) << "No ethtool statistics of " << netdev_;
+    }
+    LOG(INFO) << "CC counters of " << dev << ":" << port_num << " (netdev "
+            << (netdev_.empty() ? "none" : netdev_) << "): " << names_.size();
+    return names_.empty() ? -1 : 0;
+}
+
+int htn_cc_counters::OpenEthtool(const std::vector<std::string> &patterns) {
+    sock_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_ < 0) {
+        return -1;
+    }
+    std::vector<char> sset_buf(sizeof(struct ethtool_sset_info) + sizeof(uint32_t));
+    auto sset = (struct ethtool_sset_info *)sset_buf.data();
+    sset->cmd = ETHTOOL_GSSET_INFO;
+    sset->sset_mask = 1ull << ETH_SS_STATS;
+    if (Ethtool(sock_, netdev_, sset) || !sset->sset_mask) {
+        return -1;
+    }
+    ethtool_num_ = sset->data[0];
+    std::vector<char> strings_buf(sizeof(struct ethtool_gstrings) +
+                                  (size_t)ethtool_num_ * ETH_GSTRING_LEN);
+    auto strings = (struct ethtool_gstrings *)strings_buf.data();
+    strings->cmd = ETHTOOL_GSTRINGS;
+    strings->string_set = ETH_SS_STATS;
+    strings->len = ethtool_num_;
+    if (Ethtool(sock_, netdev_, strings)) {
+        return -1;
+    }
+    for (int i = 0; i < ethtool_num_; i++) {
+        std::string name((char *)strings->data + (size_t)i * ETH_GSTRING_LEN,
+                         strnlen((char *)strings->data + (size_t)i * ETH_GSTRING_LEN,
+                                 ETH_GSTRING_LEN));
+        for (auto &pattern : patterns) {
+            if (!pattern.empty() && name.find(pattern) != std::string::npos) {
+                names_.push_back(netdev_ + "." + name);
+                ethtool_idx_.push_back(i);
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+void htn_cc_counters::Read(std::vector<uint64_t> *values) {
+    values->assign(names_.size(), 0);
+    {
+        // The monitor and the run controller both read, the port counters
+        // keep the last value of each.
+        std::lock_guard<std::mutex> guard(lock_);
+        std::vector<uint64_t> delta;
+        ReadPortCounters(&port_, &delta);
+        for (int i = 0; i < port_.size(); i++) {
+            totals_[i] += delta[i];
+            (*values)[i] = totals_[i];
+        }
+    }
+    if (ethtool_idx_.empty()) {
+        return;
+    }
+    std::vector<char> stats_buf(sizeof(struct ethtool_stats) +
+                                (size_t)ethtool_num_ * sizeof(uint64_t));
+    auto stats = (struct ethtool_stats *)stats_buf.data();
+    stats->cmd = ETHTOOL_GSTATS;
+    stats->n_stats = ethtool_num_;
+    if (Ethtool(sock_, netdev_, stats)) {
+        return;
+    }
+    for (int i = 0; i < ethtool_idx_.size(); i++) {
+        (*values)[port_.size() + i] = stats->data[ethtool_idx_[i]];
+    }
+}
+
+// Knobs ApplyCcProfile() changed, by full path, with their old values. The
+// strings are built up front so that the signal handler only needs open()
+// and write().
+struct cc_knob {
+    std::string path;
+    std::string old;
+};
+static std::vector<cc_knob> applied;
+static std::mutex applied_lock;
+
+static void RestoreOnSignal(int sig) {
+    for (auto it = applied.rbegin(); it != applied.rend(); ++it) {
+        int fd = open(it->path.c_str(), O_WRONLY);
+        if (fd >= 0) {
+            if (write(fd, it->old.data(), it->old.size()) < 0) {
+                // Nothing left to do about it
+            }
+            close(fd);
+        }
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// The host keeps the knobs after the process is gone, so they are put back
+// on every way out: the end of a run, exit() and SIGINT/SIGTERM.
+static void RestoreOnExit() {
+    static bool installed = false;
+    if (installed) {
+        return;
+    }
+    installed = true;
+    atexit(RestoreCcProfiles);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = RestoreOnSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+}
+
+static bool ReadKnob(const std::string &path, std::string *value) {
+    std::ifstream in(path);
+    return (bool)std::getline(in, *value);
+}
+
+static bool WriteKnob(const std::string &path, const std::string &value) {
+    std::ofstream out(path);
+    out << value << std::endl;
+    return (bool)out;
+}
+
+// Lines are knob=value with the knob relative to /sys/class/net/<netdev>/ecn,
+// e.g. roce_rp/rpg_ai_rate=5 or roce_np/enable/3=1. # starts a comment.
+int ApplyCcProfile(const std::string &netdev, const std::string &path) {
+    std::ifstream profile(path);
+    if (!profile) {
+        LOG(ERROR) << "Cannot open CC profile " << path;
+        return -1;
+    }
+    std::string line;
+    while (std::getline(profile, line)) {
+        line = line.substr(0, line.find('#'));
+        auto eq = line.find('=');
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        if (eq == std::string::npos) {
+            LOG(ERROR) << "Bad CC profile line: " << line;
+            return -1;
+        }
+        auto knob = line.substr(0, eq);
+        auto value = line.substr(eq + 1);
+        auto file = "/sys/class/net/" + netdev + "/ecn/" + knob;
+        std::string old;
+        if (!ReadKnob(file, &old)) {
+            PLOG(ERROR) << "Cannot read CC knob " << file;
+            return -1;
+        }
+        {
+            std::lock_guard<std::mutex> guard(applied_lock);
+            RestoreOnExit();
+            applied.push_back({file, old});
+        }
+        if (!WriteKnob(file, value)) {
+            PLOG(ERROR) << "Cannot set CC knob " << file << " to " << value;
+            return -1;
+        }
+        LOG(INFO) << "CC " << netdev << " " << knob << ": " << old << " -> " << value;
+    }
+    return 0;
+}
+
+void RestoreCcProfiles() {
+    std::lock_guard<std::mutex> guard(applied_lock);
+    // Last written first, a knob set twice ends at its original value.
+    for (auto it = applied.rbegin(); it != applied.rend(); ++it) {
+        if (!WriteKnob(it->path, it->old)) {
+            LOG(WARNING) << "Cannot restore CC knob " << it->path;
+        }
+    }
+    applied.clear();
+}
+
+}
@@ -0,0 +1,62 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+// Congestion control visibility (--cc_stats). The DCQCN counters of an RDMA
+// port (CNPs sent and handled, ECN marked packets) are read from sysfs, the
+// congestion related ethtool statistics of its netdev through SIOCETHTOOL.
+// --cc_profile writes knobs under /sys/class/net/<netdev>/ecn before a run
+// and puts them back when the run ends or the process exits.
+
+#ifndef HTN_CC_HH
+#define HTN_CC_HH
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "htn_device.hh"
+#include "htn_helper.hh"
+
+namespace Htn {
+
+class htn_cc_counters {
+public:
+    std::string netdev_;
+    std::vector<std::string> names_;
+
+    ~htn_cc_counters();
+    // The --cc_counters of the port and the ethtool statistics of its netdev
+    // whose names contain one of the --cc_ethtool substrings
+    int Open(const std::string &dev, int port_num);
+    // Current value of every counter of names_, the port counters as their
+    // increase since Open()
+    void Read(std::vector<uint64_t> *values);
+
+private:
+    std::vector<hw_counter> port_;  // sysfs counters, read like --hw_counters
+    std::vector<uint64_t> totals_;
+    std::mutex lock_;
+    std::vector<int> ethtool_idx_;  // ethtool statistics, after the sysfs ones
+    int ethtool_num_ = 0;
+    int sock_ = -1;
+
+    int OpenEthtool(const std::vector<std::string> &patterns);
+};
+
+// Netdev of a RoCE port, empty for InfiniBand ports
+std::string NetdevOf(const std::string &dev, int port_num);
+
+// Apply the knob=value lines of `path` to the ecn directory of `netdev`. The
+// old values are restored by RestoreCcProfiles(), at exit and on SIGINT or
+// SIGTERM at the latest.
+int ApplyCcProfile(const std::string &netdev, const std::string &path);
+// Put back every knob changed so far
+void RestoreCcProfiles();
+
+}
+
+#endif
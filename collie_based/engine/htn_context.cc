@@ -6,29 +6,61 @@
 // See LICENSE for license information
 
 #include "htn_context.hh"
+#include "htn_coord.hh"
+#include "htn_results.hh"
+
+#include <random>
 
 namespace Htn {
 
 int htn_context::Init() {
     LOG(INFO) << "context init!";
-    // file format: 
-    // service_type write_num read_num send_recv_num mr_num sg_num data_size
+    // Every sampler and the run controller tick on this interval.
+    if (FLAGS_stats_interval_ms <= 0) {
+        LOG(ERROR) << "--stats_interval_ms must be positive";
+        return -1;
+    }
+    if (FLAGS_fair_interval_ms <= 0) {
+        LOG(ERROR) << "--fair_interval_ms must be positive";
+        return -1;
+    }
+    if (FLAGS_cq_poll_budget < 0) {
+        LOG(ERROR) << "--cq_poll_budget must not be negative, 0 drains the CQ";
+        return -1;
+    }
+    if (FLAGS_max_inline < 0) {
+        LOG(ERROR) << "--max_inline must not be negative";
+        return -1;
+    }
+    if (FLAGS_dci_num <= 0 || FLAGS_dc_flow_depth <= 0) {
+        LOG(ERROR) << "--dci_num and --dc_flow_depth must be positive";
+        return -1;
+    }
+    // file format: see ParseTestQp()
     std::ifstream test_file("test_case_demo");
+    std::istringstream case_stream(case_text_);
+    std::istream &cases = case_text_.empty() ? (std::istream &)test_file : case_stream;
     std::string qp_info;
-    while (std::getline(test_file, qp_info)) {
-        test_qp test;
-        std::stringstream qp_info_stream(qp_info);
-        qp_info_stream >> test.service_type;
-        qp_info_stream >> test.write_num;
-        qp_info_stream >> test.read_num;
-        qp_info_stream >> test.send_recv_num;
-        qp_info_stream >> test.mr_num;
-        total_mr_num_ += test.mr_num;
-        qp_info_stream >> test.sg_num;
-        qp_info_stream >> test.data_size;
+    int mr_num_per_host = 0;
+    while (std::getline(cases, qp_info)) {
+        if (qp_info.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        test_qp test = test_qp();
+        if (ParseTestQp(qp_info, &test)) {
+            return -1;
+        }
+        if (test.mr_num <= 0) {
+            test.mr_num = FLAGS_mr_num_per_qp;
+        }
+        mr_offset_.push_back(mr_num_per_host);
+        mr_num_per_host += test.mr_num;
         test_case.push_back(test);
     }
     num_qp_per_host_ = test_case.size();
+    // Every endpoint owns the mr_num regions of its case line.
+    mr_num_per_host_ = mr_num_per_host;
+    total_mr_num_ = num_of_hosts_ * mr_num_per_host;
     LOG(INFO) << "test case ready!";
     if (InitDevice() < 0) {
         LOG(ERROR) << "InitDevice() failed";
@@ -51,42 +83,63 @@ int htn_context::Init() {
 int htn_context:: InitDevice() {
     //std::cout << "enter InitDevice!" << std::endl;
     LOG(INFO) << "enter InitDevice!";
-    struct ibv_device *dev = nullptr;
     struct ibv_device **device_list = nullptr;
     int dev_num;
-    bool found_device = false;
     device_list = ibv_get_device_list(&dev_num);
-    std::cout << "get device" << std::endl;
     LOG(INFO) << "get device! device num: " << dev_num;
     if (!device_list) {
         LOG(ERROR) << "ibv_get_device_list() failed!";
         return -1;
     }
-    for (int i = 0; i < dev_num; i++) {
-        dev = device_list[i];
-        if (!strncmp(ibv_get_device_name(dev), device_name_.c_str(), strlen(device_name_.c_str()))) {
-            found_device = true;
-            break;
+    // --dev is a comma separated list of name[:port], e.g. mlx5_0:1,mlx5_0:2
+    for (auto &spec : ParseHost(FLAGS_dev)) {
+        auto colon = spec.find(':');
+        auto name = spec.substr(0, colon);
+        long port_num = 1;
+        if (colon != std::string::npos) {
+            auto port = spec.substr(colon + 1);
+            char *end = nullptr;
+            port_num = strtol(port.c_str(), &end, 10);
+            if (port.empty() || *end || port_num < 1 || port_num > 255) {
+                LOG(ERROR) << "Bad port in --dev " << spec;
+                ibv_free_device_list(device_list);
+                return -1;
+            }
         }
+        struct ibv_device *dev = nullptr;
+        for (int i = 0; i < dev_num; i++) {
+            if (!strncmp(ibv_get_device_name(device_list[i]), name.c_str(), name.size())) {
+                dev = device_list[i];
+                break;
+            }
+        }
+        if (!dev) {
+            LOG(ERROR) << "Device " << name << " not found!";
+            ibv_free_device_list(device_list);
+            return -1;
+        }
+        auto device = new htn_device(ibv_get_device_name(dev), port_num);
+        if (device->Open(dev)) {
+            ibv_free_device_list(device_list);
+            return -1;
+        }
+        devices_.push_back(device);
     }
-    //LOG(INFO) << "stage 1";
-    if (!found_device) {
-        LOG(ERROR) << "Device" << device_name_ << "not found!";
-    }
-    ctx_ = ibv_open_device(dev);
-    if (!ctx_) {
-        LOG(ERROR) << "cannot open device";
+    ibv_free_device_list(device_list);
+    if (devices_.empty()) {
+        LOG(ERROR) << "No device given by --dev";
         return -1;
     }
-    //LOG(INFO) << "stage 2";
+    local_gid_ = devices_[0]->gid_;
     int num_of_qps = InitIds();
     endpoints_.resize(num_of_qps, nullptr);
-    struct ibv_port_attr port_attr;
-    if (ibv_query_port(ctx_, 1, &port_attr)) {
-        PLOG(ERROR) << "ibv_query_port() failed";
-        exit(1);
+    // One array for all endpoints, the datapath loops walk it in order.
+    endpoint_pool_ = (htn_endpoint *)aligned_alloc(alignof(htn_endpoint),
+                                                   num_of_qps * sizeof(htn_endpoint));
+    if (!endpoint_pool_) {
+        LOG(ERROR) << "Cannot allocate " << num_of_qps << " endpoints";
+        return -1;
     }
-    lid_ = port_attr.lid;
     // sl_ = port_attr.sm_sl;
     port_ = FLAGS_port;
     LOG(INFO) << "exit InitDevice!";
@@ -105,53 +158,82 @@ int htn_context::InitIds() {
 }
 
 int htn_context::InitMemory() {
-    // In default, each MR has a identical PD.
-    int pd_num = 1;
-    for (int i = 0; i < pd_num; i++) {
-        struct ibv_pd *pd = ibv_alloc_pd(ctx_);
-        if (!pd) {
-            PLOG(ERROR) << "ibv_alloc_pd() failed";
+    // --pd_mode decides how many PDs each device gets, see PdOf().
+    int max_group = 0;
+    for (auto &qp_case : test_case) {
+        max_group = std::max(max_group, qp_case.group);
+    }
+    for (int d = 0; d < devices_.size(); d++) {
+        auto device = devices_[d];
+        int pd_num = 1;
+        if (FLAGS_pd_mode == "qp") {
+            pd_num = (endpoints_.size() + devices_.size() - 1 - d) / devices_.size();
+        } else if (FLAGS_pd_mode == "group") {
+            pd_num = max_group + 1;
+        } else if (FLAGS_pd_mode == "rr") {
+            pd_num = std::max(1, FLAGS_pd_num);
+        } else if (FLAGS_pd_mode != "single") {
+            LOG(ERROR) << "Unknown --pd_mode " << FLAGS_pd_mode;
             return -1;
         }
-        pds_.push_back(pd);
+        LOG(INFO) << "dev " << device->GetName() << " uses " << pd_num << " PDs";
+        for (int i = 0; i < pd_num; i++) {
+            struct ibv_pd *pd = ibv_alloc_pd(device->ctx_);
+            if (!pd) {
+                PLOG(ERROR) << "ibv_alloc_pd() failed";
+                return -1;
+            }
+            device->pds_.push_back(pd);
+        }
     }
     LOG(INFO) << "Finish PD generation!";
     int buffer_size = FLAGS_buf_size;
     LOG(INFO) << "buffer_size: " << buffer_size;
-    for (int i = 0; i < total_mr_num_; i++) {
-        LOG(INFO) << "total_mr_num_: " << total_mr_num_ << "; i: " << i;
-        //htn_region* region = new htn_region(pds_[i], buffer_size, FLAGS_buf_num, false, 0);
-        htn_region* region = new htn_region(pds_[0], buffer_size, FLAGS_buf_num, false, 0); // todo: multiple PD
-        if (region->Mallocate()) {
-            LOG(ERROR) << "Region Memory allocation failed";
-            break;
-        }
-        LOG(INFO) << "Send memory region allocated!";
-        send_mempool_.push_back(region);
-        //region = new htn_region(pds_[i], buffer_size, FLAGS_buf_num, false, 0);
-        region = new htn_region(pds_[0], buffer_size, FLAGS_buf_num, false, 0);
-        if (region->Mallocate()) {
-            LOG(ERROR) << "Region Memory allocation failed";
-            break;
-        }
-        recv_mempool_.push_back(region);
-        LOG(INFO) << "Receive memory region allocated!";
+    if (InitRegions() < 0) {
+        LOG(ERROR) << "Region Memory allocation failed";
+        return -1;
     }
     LOG(INFO) << "Finish MR Generation!";
+    if (FLAGS_verify) {
+        // Receive regions are what remote READs fetch, give them a stamp.
+        auto read_size = VerifyReadSize();
+        if (read_size > 0 && read_size <= buffer_size) {
+            for (int i = 0; i < recv_mempool_.size(); i++) {
+                auto region = recv_mempool_[i];
+                for (int k = 0; k < region->num_; k++) {
+                    VerifyStamp((char *)region->addr_ + (uint64_t)k * region->size_,
+                                read_size, kVerifyAnyQp, i);
+                }
+            }
+        }
+    }
 
     // Allocate CQ
+    if (FLAGS_cq_mode != "poll") {
+        if (FLAGS_cq_mode != "event" && FLAGS_cq_mode != "hybrid") {
+            LOG(ERROR) << "Unknown --cq_mode " << FLAGS_cq_mode;
+            return -1;
+        }
+        for (auto device : devices_) {
+            if (device->OpenChannel()) {
+                return -1;
+            }
+        }
+    }
     int cqn = num_of_hosts_ * num_qp_per_host_;
     for (int i = 0; i < cqn; i++) {
         union htn_cq send_cq;
         union htn_cq recv_cq;
+        auto ctx = DeviceOf(i)->ctx_;
+        auto channel = DeviceOf(i)->channel_;
         send_cq.cq =
-            ibv_create_cq(ctx_, FLAGS_cq_depth / cqn, nullptr, nullptr, 0);
+            ibv_create_cq(ctx, FLAGS_cq_depth / cqn, nullptr, channel, 0);
         if (!send_cq.cq) {
             PLOG(ERROR) << "ibv_create_cq() failed";
             return -1;
         }
         recv_cq.cq =
-            ibv_create_cq(ctx_, FLAGS_cq_depth / cqn, nullptr, nullptr, 0);
+            ibv_create_cq(ctx, FLAGS_cq_depth / cqn, nullptr, channel, 0);
         if (!recv_cq.cq) {
             PLOG(ERROR) << "ibv_create_cq() failed";
             return -1;
@@ -165,23 +247,1039 @@ int htn_context::InitMemory() {
 int htn_context::InitTransport() {
     htn_endpoint *ep = nullptr;
     int cnt = 0;
+    int clamped = 0;
+    int topology = ParseRecvTopology(FLAGS_recv_topology);
+    if (topology < 0) {
+        return -1;
+    }
+    if (FLAGS_srq_depth <= 0) {
+        LOG(ERROR) << "--srq_depth must be positive";
+        return -1;
+    }
+    if (ParseAddrPattern(FLAGS_addr_pattern) < 0) {
+        LOG(ERROR) << "Unknown --addr_pattern " << FLAGS_addr_pattern;
+        return -1;
+    }
+    if (FLAGS_addr_ring < 1 || FLAGS_addr_ring > (1 << 30)) {
+        LOG(ERROR) << "--addr_ring must be in [1, 2^30]";
+        return -1;
+    }
+    if (ParseAlignClass(FLAGS_local_align) < 0) {
+        LOG(ERROR) << "Unknown --local_align " << FLAGS_local_align;
+        return -1;
+    }
+    if (FLAGS_local_offset < 0 || FLAGS_local_offset >= (int)kPageBytes) {
+        LOG(ERROR) << "--local_offset must be in [0, " << kPageBytes << ")";
+        return -1;
+    }
+    if (FLAGS_zipf_theta <= 0 || FLAGS_zipf_theta >= 1) {
+        LOG(ERROR) << "--zipf_theta must be in (0, 1)";
+        return -1;
+    }
+    if (topology != kRecvPerQp && FLAGS_verify) {
+        LOG(ERROR) << "--verify maps receives to slots per QP, use --recv_topology=qp";
+        return -1;
+    }
+    auto rss_before = ResidentBytes();
     while (!ids_.empty()) {
         int id = ids_.front();
         ids_.pop();
         if (endpoints_[id]) {
-            delete endpoints_[id];
-        }
-        struct ibv_qp_init_attr qp_init_attr = MakeQpInitAttr(
-            GetSendCq(id), GetRecvCq(id), FLAGS_send_wq_depth, FLAGS_recv_wq_depth);
-        ibv_qp *qp = ibv_create_qp(pds_[id], &qp_init_attr);
-        if (!qp) {
-            PLOG(ERROR) << "ibv_create_qp() failed";
-            delete ep;
-            return -1;
+            endpoints_[id]->~htn_endpoint();
         }
-        ep = new htn_endpoint(id, qp);
+        auto &qp_case = CaseOf(id);
+        auto qp_type = (enum ibv_qp_type)qp_case.service_type;
+        auto device = DeviceOf(id);
+        bool dc = qp_case.service_type == kQptDc;
+        ibv_qp *qp = nullptr;
+        htn_srq *srq = nullptr;
+        if (dc) {
+            // Servers get a DCT per endpoint, client endpoints are flows
+            // over the device's DCIs and have no QP.
+            if (qp_case.send_recv_num || qp_case.write_imm_num || qp_case.send_imm_num) {
+                LOG(ERROR) << "DC cases support WRITE and READ only";
+                return -1;
+            }
+            if (FLAGS_pd_mode != "single") {
+                LOG(ERROR) << "DC flows share the DCIs of their device, use --pd_mode=single";
+                return -1;
+            }
+            if (FLAGS_server) {
+                auto srq = device->DctSrq(PdOf(id));
+                qp = srq ? CreateDct(device->ctx_, PdOf(id), GetRecvCq(id), srq) : nullptr;
+                if (!qp) {
+                    PLOG(ERROR) << "Cannot create DCT " << id;
+                    return -1;
+                }
+            } else if (!device->dci_pool_) {
+                device->dci_pool_ = new htn_dci_pool();
+                if (device->dci_pool_->Init(device, PdOf(id), FLAGS_dci_num,
+                                            FLAGS_send_wq_depth, FLAGS_dci_policy)) {
+                    return -1;
+                }
+            }
+        } else if (topology == kRecvXrc && qp_type == IBV_QPT_RC) {
+            // The server receives on the XRC SRQ of the PD, client send QPs
+            // name that SRQ in every request.
+            if (FLAGS_server) {
+                srq = device->Srq(PdOf(id), true);
+                qp = srq ? CreateXrcRecvQp(device->ctx_, device->xrcd_) : nullptr;
+                qp_type = IBV_QPT_XRC_RECV;
+            } else {
+                qp = CreateXrcSendQp(device->ctx_, PdOf(id), GetSendCq(id), FLAGS_send_wq_depth);
+                qp_type = IBV_QPT_XRC_SEND;
+            }
+            if (!qp) {
+                PLOG(ERROR) << "Cannot create XRC QP " << id;
+                return -1;
+            }
+        } else {
+            struct ibv_qp_init_attr qp_init_attr = MakeQpInitAttr(
+                GetSendCq(id), GetRecvCq(id), FLAGS_send_wq_depth, FLAGS_recv_wq_depth,
+                qp_type);
+            if (topology == kRecvSrq && qp_type == IBV_QPT_RC && FLAGS_server) {
+                srq = device->Srq(PdOf(id), false);
+                if (!srq) {
+                    return -1;
+                }
+                qp_init_attr.srq = srq->srq_;
+                qp_init_attr.cap.max_recv_wr = 0;
+            }
+            qp = ibv_create_qp(PdOf(id), &qp_init_attr);
+            if (!qp) {
+                PLOG(ERROR) << "ibv_create_qp() failed";
+                return -1;
+            }
+        }
+        ep = new (&endpoint_pool_[id]) htn_endpoint(id, qp);
+        ep->qp_type_ = qp_type;
+        ep->send_credits_ = FLAGS_send_wq_depth;
+        ep->recv_credits_ = FLAGS_recv_wq_depth;
+        if (dc) {
+            ep->dci_pool_ = device->dci_pool_;
+            ep->pd_ = PdOf(id);
+            ep->recv_credits_ = 0;
+            if (!FLAGS_server) {
+                ep->send_credits_ = FLAGS_dc_flow_depth;
+            }
+        }
+        if (srq) {
+            ep->srq_ = srq;
+            srq->owners_[qp->qp_num] = ep;
+        }
+        if (srq || qp_type == IBV_QPT_XRC_SEND) {
+            ep->recv_credits_ = 0;
+        }
+        ep->send_batches_.Init(ep->send_credits_);
+        ep->case_ = qp_case;
+        int rd_atomic = ep->case_.rd_atomic ? ep->case_.rd_atomic : FLAGS_max_qp_rd_atom;
+        int dest_rd_atomic = ep->case_.dest_rd_atomic ? ep->case_.dest_rd_atomic : FLAGS_max_qp_rd_atom;
+        if (rd_atomic > device->max_init_rd_atom_ || dest_rd_atomic > device->max_rd_atom_) {
+            clamped++;
+        }
+        ep->rd_atomic_ = std::min(rd_atomic, device->max_init_rd_atom_);
+        ep->dest_rd_atomic_ = std::min(dest_rd_atomic, device->max_rd_atom_);
+        ep->mr_begin_ = (id / num_qp_per_host_) * mr_num_per_host_ +
+                        mr_offset_[id % num_qp_per_host_];
+        ep->mr_num_ = ep->case_.mr_num;
+        ep->port_num_ = device->port_num_;
+        ep->batch_lat_ = &device->batch_lat_;
+        ep->tc_ = qp_case.tc >= 0 ? qp_case.tc : FLAGS_tos;
+        ep->sl_ = qp_case.sl >= 0 ? qp_case.sl : FLAGS_sl;
+        // Without prio= the SL orders the classes, else the DSCP's priority bits.
+        int prio = qp_case.prio >= 0 ? qp_case.prio : qp_case.sl >= 0 ? ep->sl_ : ep->tc_ >> 5;
+        auto prio_class = device->Class(prio, ep->tc_, ep->sl_);
+        prio_class->endpoint_ids.push_back(id);
+        ep->class_lat_ = &prio_class->batch_lat;
+        ep->slot_ = device->endpoint_ids_.size();
+        device->endpoint_ids_.push_back(id);
+        device->active_.resize((device->endpoint_ids_.size() + 63) / 64);
         // ep->SetMaster(this);
         endpoints_[id] = ep;
+        if (FLAGS_verify && !dc && InitVerify(ep)) {
+            LOG(ERROR) << "InitVerify() failed for endpoint " << id;
+            return -1;
+        }
+    }
+    if (clamped) {
+        LOG(WARNING) << clamped << " endpoints asked for more outstanding READs than "
+                << "the device allows (max_qp_init_rd_atom " << devices_[0]->max_init_rd_atom_
+                << ", max_qp_rd_atom " << devices_[0]->max_rd_atom_ << "), clamped";
+    }
+    PrintRecvFootprint(topology, ResidentBytes() - rss_before);
+    return 0;
+}
+
+// Receive side cost of the topology: queues, posted receives and the memory
+// the process gained while creating the QPs, SRQs and their receives.
+void htn_context::PrintRecvFootprint(int topology, uint64_t rss_bytes) {
+    static const char *names[] = {"qp", "srq", "xrc"};
+    int qps = 0, queues = 0;
+    uint64_t receives = 0;
+    for (auto ep : endpoints_) {
+        if (!ep || !ep->qp_) {
+            continue;
+        }
+        qps++;
+        // XRC send QPs and DCTs have no receive queue of their own.
+        if (!ep->srq_ && ep->qp_type_ != IBV_QPT_XRC_SEND &&
+            ep->qp_type_ != (enum ibv_qp_type)kQptDc) {
+            queues++;
+            receives += FLAGS_recv_wq_depth;
+        }
+    }
+    for (auto device : devices_) {
+        for (auto &kv : device->srqs_) {
+            queues++;
+            receives += kv.second->depth_;
+        }
+    }
+    LOG(INFO) << "Receive topology " << names[topology] << ": " << qps << " QPs, "
+            << queues << " receive queues of " << receives << " receives, +"
+            << rss_bytes / 1024 << " KB resident ("
+            << (qps ? rss_bytes / qps : 0) << " B per QP)";
+}
+
+// Allocate and register the send and receive regions of all endpoints,
+// spread over --mr_reg_threads threads. Large MR counts are dominated by
+// ibv_reg_mr, whose latency distribution is reported.
+int htn_context::InitRegions() {
+    send_mempool_.resize(total_mr_num_, nullptr);
+    recv_mempool_.resize(total_mr_num_, nullptr);
+    int threads = std::max(1, std::min(FLAGS_mr_reg_threads, total_mr_num_));
+    std::vector<htn_histogram> reg_lat(threads);
+    std::vector<std::thread> workers;
+    std::atomic<bool> failed(false);
+    auto start = Now64();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            htn_device *bound = nullptr;
+            for (int i = t; i < total_mr_num_ && !failed; i += threads) {
+                // Pages are pinned by the registering thread, so register from
+                // the owner device's cores to keep them NUMA local.
+                auto device = DeviceOf(RegionOwner(i));
+                if (device != bound) {
+                    device->BindCpus();
+                    bound = device;
+                }
+                // MRs live in the PD of the QP that uses them.
+                auto pd = PdOf(RegionOwner(i));
+                auto send = new htn_region(pd, FLAGS_buf_size, FLAGS_buf_num, false, device->numa_);
+                auto recv = new htn_region(pd, FLAGS_buf_size, FLAGS_buf_num, false, device->numa_);
+                if (send->Mallocate() || recv->Mallocate()) {
+                    failed = true;
+                    break;
+                }
+                reg_lat[t].Add(send->reg_ns_);
+                reg_lat[t].Add(recv->reg_ns_);
+                send_mempool_[i] = send;
+                recv_mempool_[i] = recv;
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    if (failed) {
+        return -1;
+    }
+    for (int t = 1; t < threads; t++) {
+        reg_lat[0].Merge(reg_lat[t]);
+    }
+    LOG(INFO) << "Registered " << 2 * total_mr_num_ << " MRs with " << threads
+            << " threads in " << (Now64() - start) / 1000 << " ms, ibv_reg_mr(ns) "
+            << reg_lat[0].Summary();
+    if (FLAGS_odp_prefetch) {
+        htn_histogram prefetch_lat;
+        for (int i = 0; i < total_mr_num_; i++) {
+            prefetch_lat.Add(send_mempool_[i]->prefetch_ns_);
+            prefetch_lat.Add(recv_mempool_[i]->prefetch_ns_);
+        }
+        LOG(INFO) << "ODP prefetch(ns) " << prefetch_lat.Summary();
+    }
+    return 0;
+}
+
+// Log the ODP page fault activity of every device once per second.
+void htn_context::OdpMonitor() {
+    std::vector<odp_counters> last(devices_.size());
+    for (int i = 0; i < devices_.size(); i++) {
+        if (ReadOdpCounters(devices_[i]->name_, &last[i])) {
+            LOG(WARNING) << "Cannot read ODP counters with rdma statistic, disabled";
+            return;
+        }
+    }
+    while (1) {
+        sleep(1);
+        for (int i = 0; i < devices_.size(); i++) {
+            odp_counters now;
+            if (ReadOdpCounters(devices_[i]->name_, &now)) {
+                continue;
+            }
+            LOG(INFO) << "dev " << devices_[i]->name_ << " ODP page faults +"
+                    << now.faults - last[i].faults
+                    << " invalidations +" << now.invalidations - last[i].invalidations
+                    << " prefetched +" << now.prefetched - last[i].prefetched
+                    << " (total faults " << now.faults << ")";
+            last[i] = now;
+        }
+    }
+}
+
+// Sample the port counters of every device each stats interval and log them
+// next to the device's and its QPs' message rates of the same interval, so a
+// throughput drop can be matched with RNR NAKs, sequence errors or receive
+// buffer shortage. Only counters that moved are printed.
+void htn_context::HwCounterMonitor() {
+    std::vector<htn_device *> sampled;
+    for (auto device : devices_) {
+        if (device->OpenHwCounters(FLAGS_hw_counters)) {
+            LOG(WARNING) << "No port counters to sample on " << device->GetName();
+            continue;
+        }
+        sampled.push_back(device);
+    }
+    if (sampled.empty()) {
+        return;
+    }
+    uint64_t interval = (uint64_t)FLAGS_stats_interval_ms * 1000;
+    // Sent and received messages, the server mostly receives.
+    std::vector<uint64_t> last_msgs(endpoints_.size()), last_bytes(endpoints_.size());
+    auto last_ts = Now64();
+    auto next = last_ts;
+    std::vector<uint64_t> delta;
+    while (1) {
+        next += interval;
+        auto ts = Now64();
+        if (ts < next) {
+            usleep(next - ts);
+        }
+        ts = Now64();
+        auto t = ts - last_ts;
+        for (auto device : sampled) {
+            device->ReadHwCounters(&delta);
+            uint64_t bytes = 0, msgs = 0;
+            std::stringstream qps;
+            for (auto id : device->endpoint_ids_) {
+                auto ep = endpoints_[id];
+                uint64_t ep_msgs = ep->msgs_sent_now_ + ep->msgs_recv_now_;
+                uint64_t ep_bytes = ep->bytes_sent_now_ + ep->bytes_recv_now_;
+                qps << " " << id << ":" << (ep_msgs - last_msgs[id]) * 1.0 / t;
+                msgs += ep_msgs - last_msgs[id];
+                bytes += ep_bytes - last_bytes[id];
+                last_msgs[id] = ep_msgs;
+                last_bytes[id] = ep_bytes;
+            }
+            std::stringstream events;
+            for (int i = 0; i < delta.size(); i++) {
+                if (delta[i]) {
+                    events << " " << device->hw_counters_[i].name << " +" << delta[i];
+                }
+            }
+            LOG(INFO) << "hw dev " << device->GetName() << " ts " << ts << " Rate="
+                    << bytes * 8.0 / t / 1000.0 << " Gbps, " << msgs * 1.0 / t << " Mrps,"
+                    << (events.str().empty() ? " no counter events" : events.str())
+                    << ", qp Mrps" << qps.str();
+        }
+        last_ts = ts;
+    }
+}
+
+// Live per-QP fairness. Every --fair_interval_ms the bytes each QP moved are
+// compared with the fair share of its device (device rate / active QPs). A
+// QP under --starve_share percent of it for --starve_ms is a starvation
+// event. Jain's index and the min/max ratio of the windows are logged once
+// per second, the worst window of that second.
+void htn_context::FairnessMonitor() {
+    uint64_t interval = (uint64_t)FLAGS_fair_interval_ms * 1000;
+    std::vector<uint64_t> last(endpoints_.size());
+    std::vector<uint64_t> starve_since(endpoints_.size());
+    std::vector<bool> reported(endpoints_.size());
+    std::vector<double> worst_jain(devices_.size(), 1), worst_ratio(devices_.size(), 1);
+    auto last_ts = Now64();
+    auto next = last_ts;
+    auto report_ts = last_ts;
+    while (1) {
+        next += interval;
+        auto ts = Now64();
+        if (ts < next) {
+            usleep(next - ts);
+        }
+        ts = Now64();
+        auto t = ts - last_ts;
+        last_ts = ts;
+        for (int d = 0; d < devices_.size(); d++) {
+            std::vector<int> ids;
+            std::vector<double> rates;
+            double total = 0;
+            for (auto id : devices_[d]->endpoint_ids_) {
+                auto ep = endpoints_[id];
+                uint64_t bytes = ep->bytes_sent_now_ + ep->bytes_recv_now_;
+                auto rate = (bytes - last[id]) * 8.0 / t / 1000.0;  // Gbps
+                last[id] = bytes;
+                // Parked QPs are failed, not starved.
+                if (!ep->activated_ || ep->state_ != kEpActive) {
+                    starve_since[id] = 0;
+                    continue;
+                }
+                ids.push_back(id);
+                rates.push_back(rate);
+                total += rate;
+            }
+            if (ids.empty() || total == 0) {
+                continue;
+            }
+            auto fair = total / ids.size();
+            auto minmax = std::minmax_element(rates.begin(), rates.end());
+            worst_jain[d] = std::min(worst_jain[d], JainIndex(rates));
+            worst_ratio[d] = std::min(worst_ratio[d], *minmax.first / *minmax.second);
+            for (int i = 0; i < ids.size(); i++) {
+                auto id = ids[i];
+                if (rates[i] * 100 < fair * FLAGS_starve_share) {
+                    if (!starve_since[id]) {
+                        starve_since[id] = ts - t;
+                    }
+                    if (!reported[id] && ts - starve_since[id] >= (uint64_t)FLAGS_starve_ms * 1000) {
+                        reported[id] = true;
+                        starvation_events_++;
+                        LOG(WARNING) << "STARVATION conn " << id << " on " << devices_[d]->GetName()
+                                << " since " << starve_since[id] << ": " << rates[i]
+                                << " Gbps, fair share " << fair << " Gbps";
+                    }
+                } else if (starve_since[id]) {
+                    if (reported[id]) {
+                        LOG(WARNING) << "Starvation of conn " << id << " ended after "
+                                << (ts - starve_since[id]) / 1000 << " ms";
+                    }
+                    starve_since[id] = 0;
+                    reported[id] = false;
+                }
+            }
+        }
+        if (ts - report_ts < 1000000) {
+            continue;
+        }
+        for (int d = 0; d < devices_.size(); d++) {
+            int starving = 0;
+            for (auto id : devices_[d]->endpoint_ids_) {
+                starving += starve_since[id] != 0;
+            }
+            LOG(INFO) << "fairness dev " << devices_[d]->GetName() << " jain " << worst_jain[d]
+                    << " min/max " << worst_ratio[d] << ", " << starving << " QPs below "
+                    << FLAGS_starve_share << "% of fair share, " << starvation_events_
+                    << " starvation events";
+            worst_jain[d] = 1;
+            worst_ratio[d] = 1;
+        }
+        report_ts = ts;
+    }
+}
+
+// Write one record per QP and stats interval to the --results log. Only this
+// thread touches the mapping, the datapath just keeps counting.
+void htn_context::ResultsLogger() {
+    uint64_t interval = (uint64_t)FLAGS_stats_interval_ms * 1000;
+    // Server endpoints start as their clients connect.
+    while (FLAGS_server) {
+        int waiting = 0;
+        for (auto ep : endpoints_) {
+            waiting += ep && !ep->activated_;
+        }
+        if (!waiting) {
+            break;
+        }
+        usleep(interval);
+    }
+    std::vector<results_qp> qps;
+    std::vector<htn_endpoint *> eps;
+    for (auto ep : endpoints_) {
+        if (!ep || !ep->activated_) {
+            continue;
+        }
+        auto &test = ep->case_;
+        results_qp qp = results_qp();
+        qp.id = ep->id_;
+        qp.service_type = test.service_type;
+        qp.write_num = test.write_num;
+        qp.read_num = test.read_num;
+        qp.send_recv_num = test.send_recv_num;
+        qp.write_imm_num = test.write_imm_num;
+        qp.send_imm_num = test.send_imm_num;
+        qp.mr_num = test.mr_num;
+        qp.sg_num = test.sg_num;
+        qp.data_size = test.data_size;
+        qp.group = test.group;
+        qp.port_num = ep->port_num_;
+        qps.push_back(qp);
+        eps.push_back(ep);
+    }
+    if (qps.empty()) {
+        LOG(WARNING) << "No endpoints to write to " << FLAGS_results;
+        return;
+    }
+    // The ring holds whole intervals of all QPs.
+    uint64_t capacity = std::max<uint64_t>(FLAGS_results_records / qps.size(), 1) * qps.size();
+    auto log = new htn_results_log();
+    auto last_ts = Now64();
+    if (log->Open(FLAGS_results, FLAGS_dev, qps, capacity, interval, last_ts)) {
+        delete log;
+        return;
+    }
+    std::vector<uint64_t> bytes(eps.size()), msgs(eps.size()), recv_bytes(eps.size()),
+        recv(eps.size()), errors(eps.size());
+    auto next = last_ts;
+    while (1) {
+        next += interval;
+        auto ts = Now64();
+        if (ts < next) {
+            usleep(next - ts);
+        }
+        ts = Now64();
+        for (int i = 0; i < eps.size(); i++) {
+            auto ep = eps[i];
+            results_record record = results_record();
+            record.timestamp = ts;
+            record.qp = ep->id_;
+            record.phase = phase_;
+            record.state = ep->state_;
+            record.duration = ts - last_ts;
+            record.bytes = ep->bytes_sent_now_ - bytes[i];
+            record.msgs = ep->msgs_sent_now_ - msgs[i];
+            record.recv_bytes = ep->bytes_recv_now_ - recv_bytes[i];
+            record.recv_msgs = ep->msgs_recv_now_ - recv[i];
+            record.errors = ep->errors_ - errors[i];
+            bytes[i] += record.bytes;
+            msgs[i] += record.msgs;
+            recv_bytes[i] += record.recv_bytes;
+            recv[i] += record.recv_msgs;
+            errors[i] += record.errors;
+            log->Append(record);
+        }
+        last_ts = ts;
+    }
+}
+
+// Aggregate view of the endpoints of one device, reported every second next
+// to the per-connection lines. The first device also rolls up all devices.
+void htn_context::PrintDeviceStats(htn_device *device, uint64_t timestamp) {
+    if (device->stats_ts_ == 0) {
+        device->stats_ts_ = timestamp;
+        return;
+    }
+    auto t = timestamp - device->stats_ts_;
+    if (t < 1000000) {
+        return;
+    }
+    uint64_t bytes = 0, msgs = 0;
+    for (auto id : device->endpoint_ids_) {
+        // Sent and received, a server device only receives.
+        bytes += endpoints_[id]->bytes_sent_now_ + endpoints_[id]->bytes_recv_now_;
+        msgs += endpoints_[id]->msgs_sent_now_ + endpoints_[id]->msgs_recv_now_;
+    }
+    auto cpu = htn_device::ThreadCpuUs();
+    LOG(INFO) << "dev " << device->GetName() << " total Rate="
+            << (bytes - device->stats_bytes_) * 8.0 / t / 1000.0 << " Gbps, "
+            << (msgs - device->stats_msgs_) * 1.0 / t << " Mrps, batch latency(us) "
+            << device->batch_lat_.Summary(1000) << ", cpu "
+            << (cpu - device->stats_cpu_us_) * 100.0 / t << "% (" << FLAGS_cq_mode
+            << ", " << device->wakeups_ - device->stats_wakeups_ << " wakeups, "
+            << device->polls_ - device->stats_polls_ << " CQ polls)";
+    if (device->dci_pool_) {
+        auto pool = device->dci_pool_;
+        LOG(INFO) << "dev " << device->GetName() << " dc " << pool->dcis_.size() << " DCIs ("
+                << FLAGS_dci_policy << "), " << (pool->batches_ - pool->stats_batches_) * 1e6 / t
+                << " batches/s, " << (pool->reconnects_ - pool->stats_reconnects_) * 1e6 / t
+                << " DCI reconnects/s, " << pool->waiting_.size() << " flows waiting";
+        pool->stats_batches_ = pool->batches_;
+        pool->stats_reconnects_ = pool->reconnects_;
+    }
+    if (device->classes_.size() > 1) {
+        PrintClassStats(device, t);
+    }
+    device->batch_lat_.Reset();
+    device->stats_ts_ = timestamp;
+    device->stats_bytes_ = bytes;
+    device->stats_msgs_ = msgs;
+    device->stats_cpu_us_ = cpu;
+    device->stats_wakeups_ = device->wakeups_;
+    device->stats_polls_ = device->polls_;
+    if (device != devices_[0] || devices_.size() == 1) {
+        return;
+    }
+    // Counters of other devices are read without locking, good enough for
+    // a once per second summary.
+    bytes = 0;
+    msgs = 0;
+    for (auto ep : endpoints_) {
+        if (ep) {
+            bytes += ep->bytes_sent_now_ + ep->bytes_recv_now_;
+            msgs += ep->msgs_sent_now_ + ep->msgs_recv_now_;
+        }
+    }
+    if (stats_ts_) {
+        t = timestamp - stats_ts_;
+        LOG(INFO) << "all " << devices_.size() << " devices total Rate="
+                << (bytes - stats_bytes_) * 8.0 / t / 1000.0 << " Gbps, "
+                << (msgs - stats_msgs_) * 1.0 / t << " Mrps";
+    }
+    stats_ts_ = timestamp;
+    stats_bytes_ = bytes;
+    stats_msgs_ = msgs;
+}
+
+// Rate and batch latency of each priority class of the device. A class whose
+// p99 batch latency is above that of a lower priority class in the same
+// interval is a priority inversion: the high priority flows are not
+// isolated from the others.
+void htn_context::PrintClassStats(htn_device *device, uint64_t t) {
+    for (auto c : device->classes_) {
+        uint64_t bytes = 0, msgs = 0;
+        for (auto id : c->endpoint_ids) {
+            bytes += endpoints_[id]->bytes_sent_now_ + endpoints_[id]->bytes_recv_now_;
+            msgs += endpoints_[id]->msgs_sent_now_ + endpoints_[id]->msgs_recv_now_;
+        }
+        LOG(INFO) << "dev " << device->GetName() << " prio " << c->prio << " (tc " << c->tc
+                << " sl " << c->sl << ", " << c->endpoint_ids.size() << " QPs) Rate="
+                << (bytes - c->stats_bytes) * 8.0 / t / 1000.0 << " Gbps, "
+                << (msgs - c->stats_msgs) * 1.0 / t << " Mrps, batch latency(us) "
+                << c->batch_lat.Summary(1000) << ", inversions " << c->inversions;
+        c->stats_bytes = bytes;
+        c->stats_msgs = msgs;
+    }
+    // Classes are ordered by priority, highest first.
+    for (int i = 0; i < device->classes_.size(); i++) {
+        auto high = device->classes_[i];
+        if (high->batch_lat.count_ == 0) {
+            continue;
+        }
+        for (int j = i + 1; j < device->classes_.size(); j++) {
+            auto low = device->classes_[j];
+            if (low->prio == high->prio || low->batch_lat.count_ == 0) {
+                continue;
+            }
+            auto high_p99 = high->batch_lat.Percentile(99);
+            auto low_p99 = low->batch_lat.Percentile(99);
+            if (high_p99 > low_p99) {
+                high->inversions++;
+                LOG(WARNING) << "dev " << device->GetName() << " priority inversion: prio "
+                        << high->prio << " p99 " << high_p99 / 1000.0 << " us above prio "
+                        << low->prio << " p99 " << low_p99 / 1000.0 << " us";
+                break;
+            }
+        }
+    }
+    for (auto c : device->classes_) {
+        c->batch_lat.Reset();
+    }
+}
+
+// PD of an endpoint according to --pd_mode. Endpoints of a device are its
+// ids id % devices_.size(), so id / devices_.size() is the rank on it.
+struct ibv_pd *htn_context::PdOf(int id) {
+    auto device = DeviceOf(id);
+    int idx = 0;
+    if (FLAGS_pd_mode == "qp") {
+        idx = id / devices_.size();
+    } else if (FLAGS_pd_mode == "group") {
+        idx = CaseOf(id).group;
+    } else if (FLAGS_pd_mode == "rr") {
+        idx = (id / devices_.size()) % device->pds_.size();
+    }
+    return device->pds_[idx];
+}
+
+// Map a region index to the endpoint owning it.
+int htn_context::RegionOwner(int region) {
+    int host = region / mr_num_per_host_;
+    int line = std::upper_bound(mr_offset_.begin(), mr_offset_.end(),
+                                region % mr_num_per_host_) - mr_offset_.begin() - 1;
+    return host * num_qp_per_host_ + line;
+}
+
+// The buffer an endpoint exposes to its peer and receives into. It comes from
+// the endpoint's own regions so that it is registered on the right device.
+htn_buffer *htn_context::ExposedBuffer(htn_endpoint *ep) {
+    return recv_mempool_[ep->mr_begin_]->buffers_.front();
+}
+
+// Local placement of an endpoint's messages, see htn_align_class. Offsets
+// depend on where each region landed, so they are computed per region.
+int htn_context::InitAlignment(htn_endpoint *ep) {
+    auto &c = ep->case_;
+    int align = c.align >= 0 ? c.align : ParseAlignClass(FLAGS_local_align);
+    uint32_t misalign = c.offset >= 0 ? c.offset : FLAGS_local_offset;
+    ep->local_offsets_.clear();
+    delete ep->local_ring_;
+    ep->local_ring_ = nullptr;
+    // --verify stamps its own buffers
+    if (ep->verify_send_) {
+        align = kAlignBase;
+    }
+    ep->align_class_ = AlignClassName(align);
+    if (align == kAlignOffset) {
+        ep->align_class_ += "+" + std::to_string(misalign);
+    }
+    if (align == kAlignBase) {
+        return 0;
+    }
+    auto first = send_mempool_[ep->mr_begin_];
+    uint64_t span = (uint64_t)first->num_ * first->size_;
+    if (align == kAlignRand) {
+        if (span < (uint64_t)c.data_size) {
+            LOG(ERROR) << "Endpoint " << ep->id_ << " regions are smaller than its messages";
+            return -1;
+        }
+        ep->local_ring_ = new htn_addr_ring();
+        // Seeded apart from the remote ring of the endpoint
+        ep->local_ring_->Init(kAddrRand, span, c.data_size, 1, FLAGS_addr_ring,
+                              ep->id_ ^ 0x9e3779b97f4a7c15ull);
+        return 0;
+    }
+    for (int k = 0; k < ep->mr_num_; k++) {
+        auto region = send_mempool_[ep->mr_begin_ + k];
+        auto offset = AlignOffset(align, (uint64_t)region->addr_, span, c.data_size, misalign);
+        if (offset < 0) {
+            LOG(ERROR) << "Regions of endpoint " << ep->id_ << " cannot hold " << ep->align_class_
+                    << " messages of " << c.data_size << " bytes, raise --buf_size";
+            return -1;
+        }
+        ep->local_offsets_.push_back(offset);
+    }
+    return 0;
+}
+
+void htn_context::StartMonitors() {
+    StartMrChurn();
+    StartQpChurn();
+    if (FLAGS_recover && !FLAGS_server) {
+        std::thread recovery_thread(&htn_context::RecoveryMonitor, this);
+        recovery_thread.detach();
+    }
+    if (!FLAGS_hw_counters.empty()) {
+        std::thread hw_thread(&htn_context::HwCounterMonitor, this);
+        hw_thread.detach();
+    }
+    if (FLAGS_starve_share > 0) {
+        std::thread fairness_thread(&htn_context::FairnessMonitor, this);
+        fairness_thread.detach();
+    }
+    if (!FLAGS_results.empty()) {
+        std::thread results_thread(&htn_context::ResultsLogger, this);
+        results_thread.detach();
+    }
+    if (FLAGS_odp || FLAGS_odp_implicit) {
+        std::thread odp_thread(&htn_context::OdpMonitor, this);
+        odp_thread.detach();
+    }
+    if (FLAGS_cc_stats || !FLAGS_cc_profile.empty()) {
+        // A run on other CC settings than asked for is worthless.
+        if (InitCc()) {
+            exit(1);
+        }
+        if (FLAGS_cc_stats) {
+            std::thread cc_thread(&htn_context::CcMonitor, this);
+            cc_thread.detach();
+        }
+    }
+}
+
+// Open the CC counters of every device and apply --cc_profile to its netdev.
+int htn_context::InitCc() {
+    for (auto device : devices_) {
+        device->cc_ = new htn_cc_counters();
+        if (device->cc_->Open(device->name_, device->port_num_) && FLAGS_cc_stats) {
+            LOG(WARNING) << "No CC counters to sample on " << device->GetName();
+        }
+        if (FLAGS_cc_profile.empty()) {
+            continue;
+        }
+        if (device->cc_->netdev_.empty()) {
+            LOG(ERROR) << "--cc_profile needs a RoCE port, " << device->GetName() << " has no netdev";
+            return -1;
+        }
+        if (ApplyCcProfile(device->cc_->netdev_, FLAGS_cc_profile)) {
+            RestoreCcProfiles();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Log the CC counters that moved, per second, next to the device rate of the
+// same interval: throughput lost with CNPs handled is DCQCN throttling, lost
+// without them points at the NIC itself.
+void htn_context::CcMonitor() {
+    uint64_t interval = (uint64_t)FLAGS_stats_interval_ms * 1000;
+    std::vector<std::vector<uint64_t>> last(devices_.size());
+    std::vector<uint64_t> last_bytes(devices_.size());
+    for (int d = 0; d < devices_.size(); d++) {
+        devices_[d]->cc_->Read(&last[d]);
+    }
+    auto last_ts = Now64();
+    auto next = last_ts;
+    std::vector<uint64_t> values;
+    while (1) {
+        next += interval;
+        auto ts = Now64();
+        if (ts < next) {
+            usleep(next - ts);
+        }
+        ts = Now64();
+        auto t = ts - last_ts;
+        for (int d = 0; d < devices_.size(); d++) {
+            auto device = devices_[d];
+            device->cc_->Read(&values);
+            uint64_t bytes = 0;
+            for (auto id : device->endpoint_ids_) {
+                bytes += endpoints_[id]->bytes_sent_now_ + endpoints_[id]->bytes_recv_now_;
+            }
+            std::stringstream events;
+            for (int i = 0; i < values.size(); i++) {
+                if (values[i] > last[d][i]) {
+                    events << " " << device->cc_->names_[i] << " "
+                           << (values[i] - last[d][i]) * 1e6 / t << "/s";
+                }
+            }
+            LOG(INFO) << "cc dev " << device->GetName() << " Rate="
+                    << (bytes - last_bytes[d]) * 8.0 / t / 1000.0 << " Gbps,"
+                    << (events.str().empty() ? " no CC events" : events.str());
+            last[d] = values;
+            last_bytes[d] = bytes;
+        }
+        last_ts = ts;
+    }
+}
+
+// Keep deregistering and registering a private pool of MRs while traffic
+// runs. The pool is not used by any QP, so in-flight requests never see a
+// stale key, but the NIC still has to invalidate and reload MPT/MTT entries.
+void htn_context::MrChurn() {
+    std::vector<htn_region *> pool;
+    for (int i = 0; i < FLAGS_mr_churn_num; i++) {
+        auto device = devices_[i % devices_.size()];
+        auto region = new htn_region(device->pds_[0], FLAGS_buf_size, FLAGS_buf_num, false, device->numa_);
+        if (region->Mallocate()) {
+            LOG(ERROR) << "MR churn pool allocation failed";
+            return;
+        }
+        pool.push_back(region);
+    }
+    htn_histogram reg_lat, dereg_lat;
+    uint64_t interval = FLAGS_mr_churn_rate > 0 ? 1000000000ull / FLAGS_mr_churn_rate : 0;
+    uint64_t next = Now64Ns();
+    uint64_t last_report = next;
+    uint64_t idx = 0;
+    while (1) {
+        auto now = Now64Ns();
+        if (now < next) {
+            usleep(std::min<uint64_t>((next - now) / 1000, 1000));
+            continue;
+        }
+        // Do not burst to catch up after a stall.
+        next = std::max<uint64_t>(next + interval, now - 1000000000ull);
+        auto region = pool[idx++ % pool.size()];
+        auto start = Now64Ns();
+        if (region->Deregister()) {
+            return;
+        }
+        dereg_lat.Add(Now64Ns() - start);
+        if (region->Register()) {
+            return;
+        }
+        reg_lat.Add(region->reg_ns_);
+        now = Now64Ns();
+        if (now - last_report >= 1000000000ull) {
+            LOG(INFO) << "MR churn " << reg_lat.count_ * 1000000000ull / (now - last_report)
+                    << " rereg/s, ibv_reg_mr(ns) " << reg_lat.Summary()
+                    << ", ibv_dereg_mr(ns) " << dereg_lat.Summary();
+            reg_lat.Reset();
+            dereg_lat.Reset();
+            last_report = now;
+        }
+    }
+}
+
+void htn_context::StartMrChurn() {
+    if (FLAGS_mr_churn_num <= 0) {
+        return;
+    }
+    std::thread churn_thread(&htn_context::MrChurn, this);
+    churn_thread.detach();
+}
+
+// Messages sent and received by all endpoints, read without locking
+uint64_t htn_context::TotalMsgs() {
+    uint64_t msgs = 0;
+    for (auto ep : endpoints_) {
+        if (ep) {
+            msgs += ep->msgs_sent_now_ + ep->msgs_recv_now_;
+        }
+    }
+    return msgs;
+}
+
+// Keep creating short-lived RC QP pairs while traffic runs: both QPs are
+// created, connected to each other through the local port, used for one
+// WRITE and destroyed. Each thread paces itself to its share of
+// --qp_churn_rate and reports the verbs latencies along with the message
+// rate of the data path.
+void htn_context::QpChurn(int thread_id) {
+    auto device = devices_[thread_id % devices_.size()];
+    auto pd = device->pds_[0];
+    const int kChurnBuf = 4096;
+    void *buf = aligned_alloc(4096, kChurnBuf);
+    struct ibv_mr *mr = buf ? ibv_reg_mr(pd, buf, kChurnBuf, IBV_ACCESS_LOCAL_WRITE |
+                                         IBV_ACCESS_REMOTE_WRITE) : nullptr;
+    struct ibv_cq *cq = ibv_create_cq(device->ctx_, 16, nullptr, nullptr, 0);
+    if (!mr || !cq) {
+        PLOG(ERROR) << "QP churn thread " << thread_id << " setup failed";
+        return;
+    }
+    htn_histogram create_lat, modify_lat, use_lat, destroy_lat;
+    int threads = FLAGS_qp_churn_threads;
+    uint64_t interval = FLAGS_qp_churn_rate > 0 ? 1000000000ull * threads / FLAGS_qp_churn_rate : 0;
+    uint64_t next = Now64Ns();
+    uint64_t last_report = next;
+    uint64_t last_msgs = TotalMsgs();
+    while (phase_ != kPhaseDone) {
+        auto now = Now64Ns();
+        if (now < next) {
+            usleep(std::min<uint64_t>((next - now) / 1000, 1000));
+            continue;
+        }
+        // Do not burst to catch up after a stall.
+        next = std::max<uint64_t>(next + interval, now - 1000000000ull);
+        struct ibv_qp *qp[2] = {nullptr, nullptr};
+        auto init_attr = MakeQpInitAttr(cq, cq, 16, 16, IBV_QPT_RC);
+        bool ok = true;
+        for (int k = 0; k < 2 && ok; k++) {
+            auto start = Now64Ns();
+            qp[k] = ibv_create_qp(pd, &init_attr);
+            create_lat.Add(Now64Ns() - start);
+            if (!qp[k]) {
+                PLOG(ERROR) << "QP churn: ibv_create_qp() failed";
+                ok = false;
+            }
+        }
+        for (int k = 0; k < 2 && ok; k++) {
+            for (auto state : {IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS}) {
+                int attr_mask;
+                auto attr = MakeQpAttr(state, IBV_QPT_RC, device->port_num_,
+                                       qp[1 - k]->qp_num, device->gid_, &attr_mask);
+                auto start = Now64Ns();
+                if (ibv_modify_qp(qp[k], &attr, attr_mask)) {
+                    PLOG(ERROR) << "QP churn: ibv_modify_qp() failed";
+                    ok = false;
+                    break;
+                }
+                modify_lat.Add(Now64Ns() - start);
+            }
+        }
+        if (ok) {
+            struct ibv_sge sge = {(uint64_t)buf, 64, mr->lkey};
+            struct ibv_send_wr wr, *bad_wr = nullptr;
+            memset(&wr, 0, sizeof(wr));
+            wr.opcode = IBV_WR_RDMA_WRITE;
+            wr.send_flags = IBV_SEND_SIGNALED;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.wr.rdma.remote_addr = (uint64_t)buf + kChurnBuf / 2;
+            wr.wr.rdma.rkey = mr->rkey;
+            auto start = Now64Ns();
+            struct ibv_wc wc;
+            int n = 0;
+            if (ibv_post_send(qp[0], &wr, &bad_wr) == 0) {
+                while ((n = ibv_poll_cq(cq, 1, &wc)) == 0 && Now64Ns() - start < 1000000000ull) {
+                }
+            }
+            if (n != 1 || wc.status != IBV_WC_SUCCESS) {
+                LOG(ERROR) << "QP churn: WRITE on a fresh QP pair failed";
+                ok = false;
+            } else {
+                use_lat.Add(Now64Ns() - start);
+            }
+        }
+        for (int k = 0; k < 2; k++) {
+            if (qp[k]) {
+                auto start = Now64Ns();
+                ibv_destroy_qp(qp[k]);
+                destroy_lat.Add(Now64Ns() - start);
+            }
+        }
+        if (!ok) {
+            break;
+        }
+        now = Now64Ns();
+        if (now - last_report >= 1000000000ull) {
+            auto msgs = TotalMsgs();
+            LOG(INFO) << "QP churn " << thread_id << " on " << device->GetName() << ": "
+                    << use_lat.count_ * 1000000000ull / (now - last_report)
+                    << " pairs/s, ibv_create_qp(us) " << create_lat.Summary(1000)
+                    << ", ibv_modify_qp(us) " << modify_lat.Summary(1000)
+                    << ", first WRITE(us) " << use_lat.Summary(1000)
+                    << ", ibv_destroy_qp(us) " << destroy_lat.Summary(1000)
+                    << ", data path " << (msgs - last_msgs) * 1000.0 / (now - last_report)
+                    << " Mrps";
+            create_lat.Reset();
+            modify_lat.Reset();
+            use_lat.Reset();
+            destroy_lat.Reset();
+            last_report = now;
+            last_msgs = msgs;
+        }
+    }
+    ibv_destroy_cq(cq);
+    ibv_dereg_mr(mr);
+    free(buf);
+}
+
+void htn_context::StartQpChurn() {
+    for (int i = 0; i < FLAGS_qp_churn_threads; i++) {
+        std::thread churn_thread(&htn_context::QpChurn, this, i);
+        churn_thread.detach();
+    }
+}
+
+// Allocate the private slot rings of an endpoint for --verify.
+int htn_context::InitVerify(htn_endpoint *ep) {
+    auto &qp_case = ep->case_;
+    if (qp_case.data_size < (int)sizeof(verify_hdr)) {
+        LOG(WARNING) << "Endpoint " << ep->id_ << " data_size " << qp_case.data_size
+                << " is too small to verify";
+        return 0;
+    }
+    if (qp_case.read_num && (qp_case.write_num || qp_case.write_imm_num)) {
+        LOG(WARNING) << "Endpoint " << ep->id_ << " mixes WRITE and READ on the same"
+                << " remote buffer, READ-back may report torn data";
+    }
+    auto pd = PdOf(ep->id_);
+    ep->verify_send_ = new htn_region(pd, qp_case.data_size, FLAGS_send_wq_depth,
+                                      true, 0);
+    if (ep->verify_send_->Mallocate()) {
+        return -1;
+    }
+    for (int k = 0; k < FLAGS_send_wq_depth; k++) {
+        VerifyStamp((char *)ep->verify_send_->addr_ + (uint64_t)k * qp_case.data_size,
+                    qp_case.data_size, ep->id_, k);
+    }
+    ep->verify_read_ = qp_case.read_num && qp_case.data_size == VerifyReadSize();
+    if (qp_case.send_recv_num || qp_case.send_imm_num) {
+        ep->verify_recv_ = new htn_region(pd, qp_case.data_size,
+                                          FLAGS_recv_wq_depth, true, 0);
+        if (ep->verify_recv_->Mallocate()) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// READ sources are shared by all QPs, so both sides stamp and check them with
+// the data_size of the first reading QP in the case file.
+int htn_context::VerifyReadSize() {
+    for (auto &qp_case : test_case) {
+        if (qp_case.read_num) {
+            return qp_case.data_size;
+        }
     }
     return 0;
 }
@@ -267,6 +1365,16 @@ int htn_context::AcceptHandler(int connfd) {
                 << ": Couldn't read remote address";
         goto out;
     }
+    if ((info->type) == kRecoverKey) {
+        // A client asks to reset one of our QPs, the reply reuses the buffer.
+        if (RecoverHandler(info) ||
+            write(connfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info)) {
+            goto out;
+        }
+        close(connfd);
+        free(conn_buf);
+        return 0;
+    }
     if ((info->type) != kHostInfoKey) {
         LOG(ERROR) << "The first exchange type should be " << kHostInfoKey;
         goto out;
@@ -360,22 +1468,18 @@ int htn_context::AcceptHandler(int connfd) {
             LOG(ERROR) << "Couldn't send " << i << " endpoint's info";
             goto out;
         }
-        if (ep->Activate(gid)) {
+        if (ep->Activate(ep->remote_gid_)) {
             LOG(ERROR) << "Activate Recv Endpoint " << i << " failed";
             goto out;
         }
         // Post The first batch
-        int first_batch = FLAGS_recv_wq_depth;
-        // int batch_size = FLAGS_recv_batch;
-        int batch_size = 100; // temp set
-        size_t idx = 0;
+        ep->recv_buf_ = ExposedBuffer(ep);
         while (ep->recv_credits_ > 0) {
-            auto num_to_post = std::min(first_batch, batch_size);
-            // if (ep->PostRecv(reqs, idx, num_to_post)) {
-            //     LOG(ERROR) << "The " << i << " Receiver Post first batch error";
-            //     goto out;
-            // }
-            first_batch -= num_to_post;
+            auto num_to_post = std::min(ep->recv_credits_, (uint32_t)kMaxBatch);
+            if (ep->PostRecv(num_to_post)) {
+                LOG(ERROR) << "The " << i << " Receiver Post first batch error";
+                goto out;
+            }
         }
         ep->activated_ = true;
         ep->rmem_id_ = rbuf_id;
@@ -426,11 +1530,25 @@ void htn_context::SetEndpointInfo(htn_endpoint *endpoint,
             endpoint->remote_sl_ = info->info.channel.sl;
         case IBV_QPT_UC:
         case IBV_QPT_RC:
+        case IBV_QPT_XRC_SEND:
+        case IBV_QPT_XRC_RECV:
+        case kQptDc:
             endpoint->remote_qpn_ = info->info.channel.qp_num;
+            endpoint->remote_srqn_ = info->info.channel.srqn;
+            endpoint->remote_span_ = info->info.channel.span;
             break;
         default:
             LOG(ERROR) << "Currently we don't support other type of QP";
     }
+    // Every channel carries its own gid and buffer, the peer QP may sit on
+    // another device or port than the host-level info describes.
+    memcpy(&endpoint->remote_gid_, &info->info.channel.gid, sizeof(union ibv_gid));
+    auto buf = new htn_buffer(info->info.channel.remote_addr, info->info.channel.size,
+                              0, info->info.channel.remote_K);
+    for (auto old : endpoint->remote_bufs_) {
+        delete old;
+    }
+    endpoint->remote_bufs_ = {buf};
 }
 
 // write the information of endpoint into the connection info
@@ -440,15 +1558,30 @@ void htn_context::GetEndpointInfo(htn_endpoint *endpoint,
     info->type = (kChannelInfoKey);
     switch (endpoint->qp_type_) {
         case IBV_QPT_UD:
-            info->info.channel.dlid = lid_;
+            info->info.channel.dlid = DeviceOf(endpoint->id_)->lid_;
             info->info.channel.sl = sl_;
         case IBV_QPT_UC:
         case IBV_QPT_RC:
+        case IBV_QPT_XRC_SEND:
+        case IBV_QPT_XRC_RECV:
             info->info.channel.qp_num = endpoint->qp_->qp_num;
+            info->info.channel.srqn = endpoint->srq_ ? endpoint->srq_->srqn_ : 0;
+            break;
+        case kQptDc:
+            // The DCT number, a client flow has no QP of its own
+            info->info.channel.qp_num = endpoint->qp_ ? endpoint->qp_->qp_num : 0;
             break;
         default:
             LOG(ERROR) << "Currently we don't support other type of QP";
     }
+    memcpy(&info->info.channel.gid, &DeviceOf(endpoint->id_)->gid_, sizeof(union ibv_gid));
+    auto buf = ExposedBuffer(endpoint);
+    info->info.channel.remote_addr = buf->addr_;
+    info->info.channel.remote_K = buf->remote_key_;
+    info->info.channel.size = buf->size_;
+    // The whole region is registered, address patterns may target all of it.
+    auto region = recv_mempool_[endpoint->mr_begin_];
+    info->info.channel.span = (uint64_t)region->num_ * region->size_;
 }
 
 // connection request, launched by the client
@@ -556,10 +1689,13 @@ int htn_context::Connect(const char *server, int port, int connid) {
             goto out;
         }
         SetEndpointInfo(ep, info);
-        if (ep->Activate(remote_gid)) {
+        if (ep->Activate(ep->remote_gid_)) {
             LOG(ERROR) << "Activate " << i << " endpoint failed";
             goto out;
         }
+        if (InitAlignment(ep)) {
+            goto out;
+        }
     }
 
     // go go go!
@@ -584,6 +1720,7 @@ int htn_context::Connect(const char *server, int port, int connid) {
     for (int i = 0; i < num_qp_per_host_; i++) {
         auto ep = endpoints_[i + connid * num_qp_per_host_];
         ep->activated_ = true;
+        ep->remote_host_ = server;
         ep->remote_server_ = GidToIP(remote_gid);
         ep->rmem_id_ = rbuf_id;
     }
@@ -602,37 +1739,7 @@ out:
 // }
 
 int htn_context::ConnectionSetup(const char *server, int port) {
-    struct addrinfo *res, *t;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    char *service;
-    int n;
-    int sockfd = -1;
-    int err;
-    if (asprintf(&service, "%d", port) < 0) return -1;
-    n = getaddrinfo(server, service, &hints, &res);
-    if (n < 0) {
-        LOG(ERROR) << gai_strerror(n) << " for " << server << ":" << port;
-        free(service);
-        return -1;
-    }
-    for (t = res; t; t = t->ai_next) {
-        sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
-        if (sockfd >= 0) {
-            if (!connect(sockfd, t->ai_addr, t->ai_addrlen)) break;
-            close(sockfd);
-            sockfd = -1;
-        }
-    }
-    freeaddrinfo(res);
-    free(service);
-    if (sockfd < 0) {
-        LOG(ERROR) << "Couldn't connect to " << server << ":" << port;
-        return -1;
-    }
-    return sockfd;
+    return TcpConnect(server, port);
 }
 
 void htn_context::SetInfoByBuffer(struct connect_info *info,
@@ -653,54 +1760,685 @@ std::string htn_context::GidToIP(const union ibv_gid &gid) {
     return ip;
 }
 
+// Run one datapath loop per device, the first one on the calling thread.
 int htn_context::ServerLaunch() {
+    StartMonitors();
+    std::vector<std::thread> loops;
+    for (int i = 1; i < devices_.size(); i++) {
+        loops.emplace_back(&htn_context::ServerLoop, this, devices_[i]);
+    }
+    ServerLoop(devices_[0]);
+    for (auto &loop : loops) {
+        loop.join();
+    }
+    return 0;
+}
+
+int htn_context::ServerLoop(htn_device *device) {
+    device->BindCpus();
+    uint64_t idle_since = 0;
+    while (1) {
+        auto now = Now64();
+        bool progress = false;
+        for (auto i : device->endpoint_ids_) {
+            auto ep = endpoints_[i];
+            if (ep == nullptr || ep->activated_ == false || ep->state_ == kEpParked) {
+                continue;
+            }
+            auto polled = PollEach(GetRecvCq(i), FLAGS_cq_poll_budget);
+            if (polled < 0) {
+                LOG(ERROR) << "PollEach failed!";
+                exit(1);
+            }
+            device->polls_++;
+            progress |= polled > 0;
+            ep->PrintRecvStats(now);
+            if (ep->state_ == kEpFailed) {
+                // Wait for the client to ask for a reset, see RecoverHandler().
+                ep->state_ = kEpParked;
+                continue;
+            }
+            // Refill the receive queue consumed by SEND and WRITE_WITH_IMM.
+            while (ep->recv_credits_ >= kRecvRepostBatch) {
+                auto num_to_post = std::min(ep->recv_credits_, (uint32_t)kMaxBatch);
+                if (ep->PostRecv(num_to_post)) {
+                    LOG(ERROR) << "Repost receive failed for endpoint " << i;
+                    if (!FLAGS_recover) {
+                        exit(1);
+                    }
+                    ep->state_ = kEpFailed;
+                    break;
+                }
+            }
+        }
+        for (auto &kv : device->srqs_) {
+            auto srq = kv.second;
+            if (srq->cq_) {
+                auto polled = PollEach(srq->cq_, FLAGS_cq_poll_budget);
+                if (polled < 0) {
+                    LOG(ERROR) << "PollEach failed!";
+                    exit(1);
+                }
+                device->polls_++;
+                progress |= polled > 0;
+            }
+            if (srq->Refill()) {
+                LOG(ERROR) << "Repost receive failed for the SRQ of " << device->GetName();
+                exit(1);
+            }
+        }
+        PrintDeviceStats(device, now);
+        WaitCompletions(device, progress, &idle_since);
+    }
     return 0;
 }
 
 int htn_context::ClientLaunch() {
+    launch_ts_ = Now64();
+    std::map<std::string, int> kernels, aligns;
+    for (auto ep : endpoints_) {
+        if (ep && ep->activated_) {
+            kernels[ep->post_kernel_name_]++;
+            aligns[ep->align_class_]++;
+        }
+    }
+    for (auto &kv : kernels) {
+        LOG(INFO) << kv.second << " endpoints post with the " << kv.first << " kernel";
+    }
+    for (auto &kv : aligns) {
+        LOG(INFO) << kv.second << " endpoints place messages in alignment class " << kv.first;
+    }
+    // Endpoints and 4 KB pages touched per address pattern
+    std::map<std::string, std::pair<int, uint64_t>> patterns;
+    for (auto ep : endpoints_) {
+        if (ep && ep->activated_ && ep->addr_ring_) {
+            auto &p = patterns[AddrPatternName(ep->addr_ring_->pattern_)];
+            p.first++;
+            p.second += ep->addr_ring_->Pages();
+        }
+    }
+    for (auto &kv : patterns) {
+        LOG(INFO) << kv.second.first << " endpoints target remote addresses with the "
+                << kv.first << " pattern, " << kv.second.second / kv.second.first
+                << " distinct 4 KB pages per endpoint";
+    }
+    StartMonitors();
+    std::thread controller;
+    if (FLAGS_duration > 0) {
+        controller = std::thread(&htn_context::RunController, this);
+    }
+    std::vector<std::thread> loops;
+    for (int i = 1; i < devices_.size(); i++) {
+        loops.emplace_back(&htn_context::ClientLoop, this, devices_[i]);
+    }
+    ClientLoop(devices_[0]);
+    for (auto &loop : loops) {
+        loop.join();
+    }
+    if (controller.joinable()) {
+        controller.join();
+    }
+    return 0;
+}
+
+void htn_context::TakeSnapshot(htn_snapshot *snap) {
+    snap->timestamp = Now64();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    snap->cpu_us = (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+                   usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    snap->bytes.resize(endpoints_.size());
+    snap->msgs.resize(endpoints_.size());
+    snap->total_bytes = 0;
+    snap->total_msgs = 0;
+    snap->total_errors = 0;
+    for (int i = 0; i < endpoints_.size(); i++) {
+        // Written by the datapath threads, a stale read only shifts a sample.
+        snap->bytes[i] = endpoints_[i] ? endpoints_[i]->bytes_sent_now_ : 0;
+        snap->msgs[i] = endpoints_[i] ? endpoints_[i]->msgs_sent_now_ : 0;
+        snap->total_bytes += snap->bytes[i];
+        snap->total_msgs += snap->msgs[i];
+        snap->total_errors += endpoints_[i] ? endpoints_[i]->errors_ : 0;
+    }
+    if (FLAGS_cc_stats) {
+        snap->cc.resize(devices_.size());
+        for (int d = 0; d < devices_.size(); d++) {
+            if (devices_[d]->cc_) {
+                devices_[d]->cc_->Read(&snap->cc[d]);
+            }
+        }
+    }
+}
+
+// Drive a timed run: warm up for --warmup seconds and, with --steady_cv, until
+// the message rate is steady, then measure for --duration seconds between two
+// sampling ticks so no partial interval leaks into the result.
+void htn_context::RunController() {
+    uint64_t interval = (uint64_t)FLAGS_stats_interval_ms * 1000;
+    htn_steady_detector steady(FLAGS_steady_window, FLAGS_steady_cv);
+    htn_snapshot last, now, begin;
+    TakeSnapshot(&last);
+    auto start = last.timestamp;
+    auto next = start;
+    while (phase_ != kPhaseDone) {
+        next += interval;
+        auto ts = Now64();
+        if (ts < next) {
+            usleep(next - ts);
+        }
+        TakeSnapshot(&now);
+        auto t = now.timestamp - last.timestamp;
+        auto mrps = (now.total_msgs - last.total_msgs) * 1.0 / t;
+        steady.Add(mrps);
+        LOG(INFO) << "sample phase " << phase_ << " Rate="
+                << (now.total_bytes - last.total_bytes) * 8.0 / t / 1000.0 << " Gbps, "
+                << mrps << " Mrps, cv " << steady.Cv() << ", errors +"
+                << now.total_errors - last.total_errors;
+        if (report_fd_ >= 0) {
+            coord_msg msg = coord_msg();
+            msg.type = kReportKey;
+            msg.phase = phase_;
+            msg.timestamp = now.timestamp;
+            msg.duration = t;
+            msg.bytes = now.total_bytes - last.total_bytes;
+            msg.msgs = now.total_msgs - last.total_msgs;
+            msg.errors = now.total_errors - last.total_errors;
+            SendMsg(report_fd_, msg);
+        }
+        auto elapsed = now.timestamp - start;
+        if (phase_ == kPhaseWarmup && elapsed >= (uint64_t)FLAGS_warmup * 1000000) {
+            bool timeout = elapsed >= (uint64_t)(FLAGS_warmup + FLAGS_steady_timeout) * 1000000;
+            if (FLAGS_steady_cv <= 0 || steady.Steady() || timeout) {
+                if (FLAGS_steady_cv > 0) {
+                    LOG(INFO) << (timeout ? "Steady state timeout" : "Steady state reached")
+                            << " after " << elapsed / 1000 << " ms, cv " << steady.Cv();
+                }
+                begin = now;
+                phase_ = kPhaseMeasure;
+            }
+        } else if (phase_ == kPhaseMeasure &&
+                   now.timestamp - begin.timestamp >= (uint64_t)FLAGS_duration * 1000000) {
+            phase_ = kPhaseDone;
+        }
+        last = now;
+    }
+    PrintSummary(begin, now);
+    RestoreCcProfiles();
+}
+
+void htn_context::PrintSummary(const htn_snapshot &begin, const htn_snapshot &end) {
+    auto t = end.timestamp - begin.timestamp;
+    double min_mrps = 0, max_mrps = 0;
+    std::vector<double> gbps;
+    int qp_num = 0;
+    for (int i = 0; i < endpoints_.size(); i++) {
+        if (!endpoints_[i] || !endpoints_[i]->activated_) {
+            continue;
+        }
+        auto mrps = (end.msgs[i] - begin.msgs[i]) * 1.0 / t;
+        LOG(INFO) << "conn " << i << " Rate="
+                << (end.bytes[i] - begin.bytes[i]) * 8.0 / t / 1000.0 << " Gbps, "
+                << mrps << " Mrps";
+        gbps.push_back((end.bytes[i] - begin.bytes[i]) * 8.0 / t / 1000.0);
+        min_mrps = qp_num ? std::min(min_mrps, mrps) : mrps;
+        max_mrps = qp_num ? std::max(max_mrps, mrps) : mrps;
+        qp_num++;
+    }
+    // The window split by alignment class, shown once any endpoint leaves
+    // the buffer base.
+    std::map<std::string, std::vector<uint64_t>> aligns;  // qps, bytes, msgs
+    for (int i = 0; i < endpoints_.size(); i++) {
+        auto ep = endpoints_[i];
+        if (ep && ep->activated_) {
+            auto &a = aligns[ep->align_class_];
+            a.resize(3);
+            a[0]++;
+            a[1] += end.bytes[i] - begin.bytes[i];
+            a[2] += end.msgs[i] - begin.msgs[i];
+        }
+    }
+    if (aligns.size() > 1 || (aligns.size() == 1 && aligns.begin()->first != "base")) {
+        for (auto &kv : aligns) {
+            LOG(INFO) << "align " << kv.first << " qp_num=" << kv.second[0]
+                    << " gbps=" << kv.second[1] * 8.0 / t / 1000.0
+                    << " mrps=" << kv.second[2] * 1.0 / t
+                    << " mrps_per_qp=" << kv.second[2] * 1.0 / t / kv.second[0];
+        }
+    }
+    // Error classes over the whole run, the window only carries the count.
+    uint64_t wc_errors[kWcStatusNum] = {};
+    uint64_t recoveries = 0;
+    for (auto ep : endpoints_) {
+        if (!ep) {
+            continue;
+        }
+        for (int s = 0; s < kWcStatusNum; s++) {
+            wc_errors[s] += ep->wc_errors_[s];
+        }
+        recoveries += ep->recoveries_;
+    }
+    for (int s = 0; s < kWcStatusNum; s++) {
+        if (wc_errors[s]) {
+            LOG(INFO) << "bad completions " << ibv_wc_status_str((enum ibv_wc_status)s)
+                    << ": " << wc_errors[s];
+        }
+    }
+    // CC activity of the window, the SUMMARY line carries the CNP and ECN rates.
+    // CNPs sent by the notification point (np_*, this host receives) and
+    // handled by the reaction point (rp_*, this host sends) are apart.
+    double np_cnp = 0, rp_cnp = 0, ecn = 0;
+    for (int d = 0; d < end.cc.size() && d < begin.cc.size(); d++) {
+        auto &names = devices_[d]->cc_->names_;
+        std::stringstream counters;
+        for (int i = 0; i < names.size() && i < end.cc[d].size() && i < begin.cc[d].size(); i++) {
+            // A failed read gives 0
+            auto delta = end.cc[d][i] >= begin.cc[d][i] ? end.cc[d][i] - begin.cc[d][i] : 0;
+            counters << " " << names[i] << "=" << delta;
+            if (names[i].compare(0, 6, "np_cnp") == 0) {
+                np_cnp += delta;
+            } else if (names[i].compare(0, 6, "rp_cnp") == 0) {
+                rp_cnp += delta;
+            } else if (names[i].find("ecn") != std::string::npos) {
+                ecn += delta;
+            }
+        }
+        LOG(INFO) << "cc dev " << devices_[d]->GetName() << counters.str();
+    }
+    auto errors = end.total_errors - begin.total_errors;
+    LOG(INFO) << "SUMMARY qp_num=" << qp_num << " duration_us=" << t
+            << " gbps=" << (end.total_bytes - begin.total_bytes) * 8.0 / t / 1000.0
+            << " mrps=" << (end.total_msgs - begin.total_msgs) * 1.0 / t
+            << " min_qp_mrps=" << min_mrps << " max_qp_mrps=" << max_mrps
+            << " errors=" << errors << " errors_per_s=" << errors * 1000000.0 / t
+            << " recoveries=" << recoveries
+            << " jain=" << JainIndex(gbps) << " min_max_ratio="
+            << (max_mrps > 0 ? min_mrps / max_mrps : 0)
+            << " starvation_events=" << starvation_events_
+            << " cq_mode=" << FLAGS_cq_mode
+            << " cpu_pct=" << (end.cpu_us - begin.cpu_us) * 100.0 / t
+            << " np_cnp_per_s=" << np_cnp * 1e6 / t << " rp_cnp_per_s=" << rp_cnp * 1e6 / t
+            << " ecn_per_s=" << ecn * 1e6 / t;
+    if (report_fd_ >= 0) {
+        coord_msg msg = coord_msg();
+        msg.type = kDoneKey;
+        msg.timestamp = launch_ts_;
+        msg.duration = t;
+        msg.bytes = end.total_bytes - begin.total_bytes;
+        msg.msgs = end.total_msgs - begin.total_msgs;
+        msg.errors = errors;
+        SendMsg(report_fd_, msg);
+    }
+}
+
+int htn_context::ClientLoop(htn_device *device) {
+    device->BindCpus();
 
     // parse request
 
+    uint64_t idle_since = 0;
+    uint64_t sweep_ts = 0;
+    while (phase_ != kPhaseDone) {
+        auto now = Now64();
+        bool progress = false;
+        // Sweep all endpoints now and then: statistics, and endpoints that
+        // have no completion to trigger their next post (first post, after
+        // recovery).
+        if (now - sweep_ts >= kPostSweepUs) {
+            sweep_ts = now;
+            for (auto i : device->endpoint_ids_) {
+                auto ep = endpoints_[i];
+                if (ep == nullptr || ep->activated_ == false) {
+                    continue;
+                }
+                ep->PrintThroughput(now);
+                if (ep->state_ == kEpFailed) {
+                    // Let the poll pass below park it.
+                    device->SetActive(ep->slot_);
+                } else if (ep->state_ == kEpActive && !ep->queued_) {
+                    progress |= PostBatch(device, ep, now);
+                }
+            }
+        }
+        // Poll the CQs with signaled sends in flight only, idle QPs cost
+        // nothing however many there are. A completion hands the credits
+        // back and its endpoint is reposted at once, or queued for the
+        // next flush with --post_coalesce_us.
+        for (int w = 0; w < device->active_.size(); w++) {
+            for (auto bits = device->active_[w]; bits; bits &= bits - 1) {
+                int slot = w * 64 + __builtin_ctzll(bits);
+                auto i = device->endpoint_ids_[slot];
+                auto ep = endpoints_[i];
+                auto polled = PollEach(GetSendCq(i), FLAGS_cq_poll_budget);
+                if (polled < 0) {
+                    LOG(ERROR) << "PollEach failed!";
+                    exit(1);
+                }
+                device->polls_++;
+                progress |= polled > 0;
+                if (ep->state_ == kEpFailed) {
+                    // Hand the QP over to RecoveryMonitor().
+                    ep->state_ = kEpParked;
+                    device->ClearActive(slot);
+                    continue;
+                }
+                if (polled > 0 && !ep->queued_) {
+                    PostBatch(device, ep, now);
+                }
+                if (ep->send_batches_.Empty()) {
+                    device->ClearActive(slot);
+                }
+            }
+        }
+        if (device->dci_pool_) {
+            auto polled = PollDci(device, now);
+            if (polled < 0) {
+                exit(1);
+            }
+            progress |= polled > 0;
+        }
+        if (!device->ready_.empty()) {
+            progress = true;
+            if (now - device->ready_ts_ >= (uint64_t)FLAGS_post_coalesce_us) {
+                for (auto slot : device->ready_) {
+                    auto ep = endpoints_[device->endpoint_ids_[slot]];
+                    if (ep->state_ == kEpActive) {
+                        PostBatch(device, ep, now);
+                    }
+                    ep->queued_ = false;
+                }
+                device->ready_.clear();
+            }
+        }
+        PrintDeviceStats(device, now);
+        WaitCompletions(device, progress, &idle_since);
+    }
+    return 0;
+}
+
+// Completions of the device's DCIs: give the DCI its entries back, complete
+// the flow's batch and repost the flow, then retry the flows that found no
+// DCI with room. DC flows take no part in error recovery, a bad completion
+// ends the run.
+int htn_context::PollDci(htn_device *device, uint64_t now) {
+    auto pool = device->dci_pool_;
+    struct ibv_wc wc[kCqPollDepth];
+    int total = 0;
+    int n;
+    while ((n = ibv_poll_cq(pool->cq_, kCqPollDepth, wc)) > 0) {
+        for (int i = 0; i < n; i++) {
+            auto ep = reinterpret_cast<htn_endpoint *>(wc[i].wr_id);
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                LOG(ERROR) << "DCI " << wc[i].qp_num << " bad completion for flow " << ep->id_
+                        << ": " << ibv_wc_status_str(wc[i].status);
+                return -1;
+            }
+            pool->dcis_[pool->Of(wc[i].qp_num)].credits += ep->send_batches_.Front().size;
+            ep->SendHandler(&wc[i]);
+            if (ep->state_ == kEpActive && !ep->queued_) {
+                PostBatch(device, ep, now);
+            }
+        }
+        total += n;
+    }
+    if (n < 0) {
+        PLOG(ERROR) << "ibv_poll_cq() failed";
+        return -1;
+    }
+    if (!pool->waiting_.empty()) {
+        std::vector<int> waiting;
+        waiting.swap(pool->waiting_);
+        for (auto id : waiting) {
+            auto ep = endpoints_[id];
+            ep->dc_waiting_ = false;
+            if (ep->state_ == kEpActive && !ep->queued_) {
+                PostBatch(device, ep, now);
+            }
+        }
+    }
+    return total;
+}
+
+// Post batches of an endpoint while its credits allow, keeping its send
+// queue full, or queue it on the device until the --post_coalesce_us flush.
+// Returns true if it did either.
+bool htn_context::PostBatch(htn_device *device, htn_endpoint *ep, uint64_t now) {
+    if (!ep->CanPost()) {
+        return false;
+    }
+    if (FLAGS_post_coalesce_us > 0 && !ep->queued_) {
+        if (device->ready_.empty()) {
+            device->ready_ts_ = now;
+        }
+        device->ready_.push_back(ep->slot_);
+        ep->queued_ = true;
+        return true;
+    }
+    ep->queued_ = false;
+    while (ep->CanPost() && ep->PostNext(send_mempool_, ep->remote_bufs_) == 0) {
+        if (!ep->dci_pool_) {
+            device->SetActive(ep->slot_);
+        }
+    }
+    return true;
+}
+
+// Between two passes of a datapath loop without progress: keep spinning
+// (poll), sleep on the completion channel (event) or spin for
+// --hybrid_spin_us and then sleep (hybrid). CQs are armed on the first idle
+// pass and slept on at the next one, so a completion racing the arming is
+// still found by the pass in between.
+void htn_context::WaitCompletions(htn_device *device, bool progress, uint64_t *idle_since) {
+    if (progress || !device->channel_) {
+        *idle_since = 0;
+        return;
+    }
+    if (FLAGS_cq_mode == "hybrid") {
+        auto now = Now64();
+        if (!*idle_since) {
+            *idle_since = now;
+        }
+        if (now - *idle_since < (uint64_t)FLAGS_hybrid_spin_us) {
+            return;
+        }
+    }
+    if (!device->armed_) {
+        for (auto id : device->endpoint_ids_) {
+            ibv_req_notify_cq(GetSendCq(id), 0);
+            ibv_req_notify_cq(GetRecvCq(id), 0);
+        }
+        for (auto &kv : device->srqs_) {
+            if (kv.second->cq_) {
+                ibv_req_notify_cq(kv.second->cq_, 0);
+            }
+        }
+        if (device->dci_pool_) {
+            ibv_req_notify_cq(device->dci_pool_->cq_, 0);
+        }
+        device->armed_ = true;
+        return;
+    }
+    // Wake up now and then for statistics and the end of the run.
+    device->WaitEvents(100);
+    *idle_since = 0;
+}
+
+// Recovery threads draw PSNs concurrently, and the two peers of a QP must
+// not repeat each other's sequence from run to run.
+static uint32_t NewPsn() {
+    static thread_local std::mt19937 rng(std::random_device{}());
+    return rng() & 0xffffff;
+}
+
+// Take an endpoint away from its datapath thread: fail it and wait until the
+// thread has drained the CQ and parked it.
+int htn_context::ParkEndpoint(htn_endpoint *ep) {
+    int expected = kEpActive;
+    ep->state_.compare_exchange_strong(expected, kEpFailed);
+    for (int i = 0; i < 1000 && ep->state_ != kEpParked; i++) {
+        usleep(1000);
+    }
+    return ep->state_ == kEpParked ? 0 : -1;
+}
+
+// Drop the completions a reset QP left behind, its requests are gone.
+void htn_context::DrainCq(int id) {
+    struct ibv_wc wc[kCqPollDepth];
+    while (ibv_poll_cq(GetSendCq(id), kCqPollDepth, wc) > 0) {
+    }
+    while (ibv_poll_cq(GetRecvCq(id), kCqPollDepth, wc) > 0) {
+    }
+}
+
+// Server side of a recovery: reset the QP connected to the client QP in
+// `info`, move it to RTS with a fresh PSN and reply with that PSN.
+int htn_context::RecoverHandler(struct connect_info *info) {
+    htn_endpoint *ep = nullptr;
+    for (auto candidate : endpoints_) {
+        if (candidate && candidate->activated_ &&
+            candidate->remote_qpn_ == (uint32_t)info->info.channel.qp_num &&
+            !memcmp(&candidate->remote_gid_, &info->info.channel.gid, sizeof(union ibv_gid))) {
+            ep = candidate;
+            break;
+        }
+    }
+    auto client_psn = info->info.channel.psn;
+    auto client_qpn = info->info.channel.qp_num;
+    memset(info, 0, sizeof(connect_info));
+    info->type = kRecoverKey;
+    if (!ep) {
+        LOG(ERROR) << "Recovery request for unknown QP " << client_qpn;
+        return 0;
+    }
+    if (ParkEndpoint(ep)) {
+        LOG(ERROR) << "Cannot park endpoint " << ep->id_ << " for recovery";
+        return 0;
+    }
+    auto psn = NewPsn();
+    DrainCq(ep->id_);
+    if (ep->RestoreFromERR(psn, client_psn)) {
+        ep->recovery_failed_++;
+        return 0;
+    }
+    DrainCq(ep->id_);
+    ep->ResetQueues();
+    while (ep->recv_credits_ > 0) {
+        if (ep->PostRecv(std::min(ep->recv_credits_, (uint32_t)kMaxBatch))) {
+            return 0;
+        }
+    }
+    ep->recoveries_++;
+    ep->recovery_failed_ = 0;
+    ep->state_ = kEpActive;
+    LOG(WARNING) << "Endpoint " << ep->id_ << " reset on request of qpn " << client_qpn;
+    info->info.channel.qp_num = ep->qp_->qp_num;
+    info->info.channel.psn = psn;
+    return 0;
+}
+
+// Client side of a recovery: ask the server to reset the peer QP, then reset
+// our own with the exchanged PSNs.
+int htn_context::RecoverEndpoint(htn_endpoint *ep) {
+    auto sockfd = ConnectionSetup(ep->remote_host_.c_str(), FLAGS_port);
+    if (sockfd < 0) {
+        return -1;
+    }
+    connect_info info;
+    memset(&info, 0, sizeof(connect_info));
+    info.type = kRecoverKey;
+    info.info.channel.qp_num = ep->qp_->qp_num;
+    memcpy(&info.info.channel.gid, &DeviceOf(ep->id_)->gid_, sizeof(union ibv_gid));
+    auto psn = NewPsn();
+    info.info.channel.psn = psn;
+    int ret = -1;
+    if (write(sockfd, &info, sizeof(connect_info)) != sizeof(connect_info) ||
+        read(sockfd, &info, sizeof(connect_info)) != sizeof(connect_info)) {
+        PLOG(ERROR) << "Recovery exchange failed for endpoint " << ep->id_;
+    } else if (info.type != kRecoverKey ||
+               (uint32_t)info.info.channel.qp_num != ep->remote_qpn_) {
+        LOG(ERROR) << "Server refused to reset the peer of endpoint " << ep->id_;
+    } else {
+        DrainCq(ep->id_);
+        ret = ep->RestoreFromERR(psn, info.info.channel.psn);
+        DrainCq(ep->id_);
+    }
+    close(sockfd);
+    return ret;
+}
+
+// Bring parked client endpoints back one by one while the others keep
+// running. An endpoint failing --max_recoveries attempts in a row stays
+// isolated.
+void htn_context::RecoveryMonitor() {
     while (1) {
-        for (int i = 0; i < endpoints_.size(); i++) {
-            if (endpoints_[i] == nullptr) {
+        usleep(10000);
+        for (auto ep : endpoints_) {
+            if (!ep || ep->state_ != kEpParked || ep->recovery_failed_ >= FLAGS_max_recoveries) {
                 continue;
             }
-            if (endpoints_[i]->activated_ == false) {
+            auto start = Now64();
+            if (start < ep->recover_ts_) {
                 continue;
             }
-            if (endpoints_[i]->send_credits_ > test_case[i].write_num + test_case[i].read_num + test_case[i].send_recv_num) {
+            if (RecoverEndpoint(ep)) {
+                // Back off, the peer may be recovering from the same storm.
+                ep->recover_ts_ = Now64() + 1000000;
+                if (++ep->recovery_failed_ >= FLAGS_max_recoveries) {
+                    LOG(ERROR) << "Endpoint " << ep->id_ << " isolated after "
+                            << ep->recovery_failed_ << " failed recoveries";
+                }
                 continue;
             }
-            endpoints_[i]->PostSend(send_mempool_, test_case[i], remote_mempools_[endpoints_[i]->rmem_id_]);
-        }
-        // poll completion
-        for (htn_cq cq : send_cqs_) {
-            if (PollEach(cq.cq) < 0) {
-                LOG(ERROR) << "PollEach failed!";
-                exit(1);
-            }
+            ep->ResetQueues();
+            ep->recoveries_++;
+            ep->recovery_failed_ = 0;
+            ep->state_ = kEpActive;
+            LOG(WARNING) << "Endpoint " << ep->id_ << " recovered in "
+                    << Now64() - start << " us, " << ep->errors_ << " errors so far";
         }
     }
-    return 0;
 }
 
-int htn_context::PollEach(struct ibv_cq *cq) {
+// Handle the completions of a CQ until it is empty, or until `budget` of them
+// were taken so that a busy CQ does not hold up the others.
+int htn_context::PollEach(struct ibv_cq *cq, int budget) {
     struct ibv_wc wc[kCqPollDepth];
+    int depth = kCqPollDepth;
     int wc_num = 0;
     int total_wc_num = 0;
     do {
-        wc_num = ibv_poll_cq(cq, kCqPollDepth, wc);
+        if (budget > 0) {
+            depth = std::min(kCqPollDepth, budget - total_wc_num);
+            if (depth == 0) {
+                break;
+            }
+        }
+        wc_num = ibv_poll_cq(cq, depth, wc);
         if (wc_num < 0) {
             PLOG(ERROR) << "ibv_poll_cq() failed";
             return -1;
         }
         for (int i = 0; i < wc_num; i++) {
+            htn_endpoint *endpoint = reinterpret_cast<htn_endpoint *>(wc[i].wr_id);
+            if (wc[i].wr_id & kSrqWrTag) {
+                // A receive of a shared queue, owned by the QP it arrived on
+                auto srq = reinterpret_cast<htn_srq *>(wc[i].wr_id & ~kSrqWrTag);
+                endpoint = srq->Owner(wc[i].qp_num);
+                // RecvHandler() returns the receive of good completions.
+                if (!endpoint || wc[i].status != IBV_WC_SUCCESS) {
+                    srq->credits_++;
+                }
+                if (!endpoint) {
+                    continue;
+                }
+            }
             if (wc[i].status != IBV_WC_SUCCESS) {
-                LOG(ERROR) << "Got bad completion status with " << wc[i].status;
-                return -1;
+                if (!FLAGS_recover) {
+                    LOG(ERROR) << "Got bad completion status with " << wc[i].status;
+                    return -1;
+                }
+                endpoint->OnError(&wc[i]);
+                continue;
             }
-            htn_endpoint *endpoint = reinterpret_cast<htn_endpoint *>(wc[i].wr_id);
             switch (wc[i].opcode) {
                 case IBV_WC_RDMA_WRITE:
                 case IBV_WC_RDMA_READ:
@@ -711,16 +2449,16 @@ int htn_context::PollEach(struct ibv_cq *cq) {
                 case IBV_WC_RECV:
                 case IBV_WC_RECV_RDMA_WITH_IMM:
                     // Server Handle CQE
-                    // endpoint->RecvHandler(&wc[i]);
-                    // break;
-                    // todo
+                    endpoint->RecvHandler(&wc[i]);
+                    break;
                 default:
                     LOG(ERROR) << "Unknown opcode " << wc[i].opcode;
                     return -1;
             }
         }
         total_wc_num += wc_num;
-    } while (wc_num > 0);
+        // A short batch means the CQ is empty, skip the poll proving it.
+    } while (wc_num == depth);
     return total_wc_num;
 }
 
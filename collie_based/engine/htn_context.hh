@@ -8,12 +8,39 @@
 #include <vector>
 #include <thread>
 #include <fstream>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <sys/resource.h>
 
 #include "htn_helper.hh"
 #include "htn_endpoint.hh"
+#include "htn_stats.hh"
+#include "htn_device.hh"
+#include "htn_dc.hh"
+#include "htn_cc.hh"
 
 namespace Htn {
 
+// Phases of a timed run (--duration)
+enum htn_phase {
+    kPhaseWarmup = 0,
+    kPhaseMeasure,
+    kPhaseDone,
+};
+
+// Counters of all endpoints at one sampling tick
+struct htn_snapshot {
+    uint64_t timestamp = 0;
+    uint64_t cpu_us = 0;  // process CPU time
+    std::vector<uint64_t> bytes;
+    std::vector<uint64_t> msgs;
+    uint64_t total_bytes = 0;
+    uint64_t total_msgs = 0;
+    uint64_t total_errors = 0;
+    std::vector<std::vector<uint64_t>> cc;  // --cc_stats counters per device
+};
+
 union htn_cq {
     struct ibv_cq *cq;
     struct ibv_cq_ex *cq_ex;
@@ -24,24 +51,29 @@ public:
     std::string device_name_;
     union ibv_gid local_gid_;
     std::string local_ip_;
-    struct ibv_context *ctx_;
-    uint16_t lid_;
     uint8_t sl_;
     int port_;
     std::queue<int> ids_;
 
     // store all test case, each unit is a test metadata for one QP
     std::vector<test_qp> test_case;
+    // Case lines handed over by a coordinator, test_case_demo is read if empty
+    std::string case_text_;
     
-    // store all endpoints(QPs)
+    // store all endpoints(QPs), endpoints_[id] points into endpoint_pool_
     std::vector<htn_endpoint *> endpoints_;
-    std::vector<struct ibv_pd *> pds_;
+    htn_endpoint *endpoint_pool_ = nullptr;
+    // opened devices (ports), endpoints are spread over them round-robin
+    std::vector<htn_device *> devices_;
 
     // Transportation
     std::vector<union htn_cq> send_cqs_;
     std::vector<union htn_cq> recv_cqs_;
 
     int total_mr_num_ = 0;
+    int mr_num_per_host_ = 0;
+    // first region of each case line within one host's regions
+    std::vector<int> mr_offset_;
 
     // Connection Setup: Server side
     int Listen();
@@ -64,8 +96,35 @@ public:
     int InitMemory();
     int InitIds();
     int InitTransport();
+    void PrintRecvFootprint(int topology, uint64_t rss_bytes);
+    int InitAlignment(htn_endpoint *ep);
+    int InitRegions();
+    int InitVerify(htn_endpoint *ep);
+    void MrChurn();
+    void StartMrChurn();
+    void QpChurn(int thread_id);
+    void StartQpChurn();
+    uint64_t TotalMsgs();
+    void OdpMonitor();
+    void StartMonitors();
+    void PrintDeviceStats(htn_device *device, uint64_t timestamp);
+    void PrintClassStats(htn_device *device, uint64_t t);
+    int RegionOwner(int region);
+    struct ibv_pd *PdOf(int id);
+    htn_buffer *ExposedBuffer(htn_endpoint *ep);
+    int VerifyReadSize();
     int AcceptHandler(int connfd);
-    int PollEach(struct ibv_cq *cq);
+    int PollEach(struct ibv_cq *cq, int budget = 0);
+    void WaitCompletions(htn_device *device, bool progress, uint64_t *idle_since);
+    bool PostBatch(htn_device *device, htn_endpoint *ep, uint64_t now);
+    int PollDci(htn_device *device, uint64_t now);
+
+    // Error recovery
+    int ParkEndpoint(htn_endpoint *ep);
+    void DrainCq(int id);
+    int RecoverHandler(struct connect_info *info);
+    int RecoverEndpoint(htn_endpoint *ep);
+    void RecoveryMonitor();
 
     void SetInfoByBuffer(struct connect_info *info, htn_buffer *buf);
 
@@ -77,6 +136,27 @@ public:
     int num_qp_per_host_ = 0;  // How many connections each host will set
     int num_of_recv_ = 0;
 
+    // Run control, datapath loops stop once the phase reaches kPhaseDone
+    std::atomic<int> phase_{kPhaseWarmup};
+    void TakeSnapshot(htn_snapshot *snap);
+    void RunController();
+    void PrintSummary(const htn_snapshot &begin, const htn_snapshot &end);
+    void HwCounterMonitor();
+    int InitCc();
+    void CcMonitor();
+    void ResultsLogger();
+    void FairnessMonitor();
+    std::atomic<uint64_t> starvation_events_{0};
+
+    // Agent mode: samples and the summary are streamed to the coordinator
+    int report_fd_ = -1;
+    uint64_t launch_ts_ = 0;
+
+    // Roll-up statistics over all devices
+    uint64_t stats_ts_ = 0;
+    uint64_t stats_bytes_ = 0;
+    uint64_t stats_msgs_ = 0;
+
     // Assitant function: Randomly choose a buffer
     // 0 indicates send buffer
     // 1 indicates recv buffer
@@ -106,6 +186,15 @@ public:
         return buf;
     }
 
+    // Test cases are described per host, endpoints of every host share them
+    const test_qp &CaseOf(int id) {
+        return test_case[id % num_qp_per_host_];
+    }
+
+    htn_device *DeviceOf(int id) {
+        return devices_[id % devices_.size()];
+    }
+
     struct ibv_cq *GetSendCq(int id) {
         // if (share_cq_) id = 0;
         // if (FLAGS_hw_ts)
@@ -124,7 +213,9 @@ public:
     void GetEndpointInfo(htn_endpoint *endpoint, struct connect_info *info);
     void SetEndpointInfo(htn_endpoint *endpoint, struct connect_info *info);
     int ServerLaunch();
+    int ServerLoop(htn_device *device);
     int ClientLaunch();
+    int ClientLoop(htn_device *device);
 };
 
 }
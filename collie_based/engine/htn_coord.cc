@@ -0,0 +1,467 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "htn_coord.hh"
+#include "htn_context.hh"
+
+#include <poll.h>
+
+namespace Htn {
+
+// Agent as seen by the coordinator
+struct agent_link {
+    std::string host;
+    int fd = -1;
+    int64_t offset = 0;  // agent clock minus coordinator clock, us
+    std::string cases;
+    std::vector<coord_msg> reports;
+    coord_msg done = coord_msg();
+    bool finished = false;
+    bool lost = false;
+};
+
+static int WriteAll(int fd, const void *buf, size_t len) {
+    auto p = (const char *)buf;
+    while (len > 0) {
+        auto n = write(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int ReadAll(int fd, void *buf, size_t len) {
+    auto p = (char *)buf;
+    while (len > 0) {
+        auto n = read(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int SendMsg(int fd, const coord_msg &msg, const std::string &payload) {
+    coord_msg out = msg;
+    out.len = payload.size();
+    if (WriteAll(fd, &out, sizeof(out))) {
+        return -1;
+    }
+    return payload.empty() ? 0 : WriteAll(fd, payload.data(), payload.size());
+}
+
+int RecvMsg(int fd, coord_msg *msg, std::string *payload) {
+    if (ReadAll(fd, msg, sizeof(*msg))) {
+        return -1;
+    }
+    std::string data(msg->len, '\0');
+    if (msg->len && ReadAll(fd, &data[0], msg->len)) {
+        return -1;
+    }
+    if (payload) {
+        *payload = data;
+    }
+    return 0;
+}
+
+// Accept the coordinator's connection on --agent_port.
+static int AcceptCoordinator(int port) {
+    struct addrinfo *res, *t;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    auto service = std::to_string(port);
+    if (getaddrinfo(nullptr, service.c_str(), &hints, &res)) {
+        LOG(ERROR) << "getaddrinfo() failed for port " << port;
+        return -1;
+    }
+    int sockfd = -1;
+    for (t = res; t; t = t->ai_next) {
+        sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
+        if (sockfd >= 0) {
+            int n = 1;
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n));
+            if (!bind(sockfd, t->ai_addr, t->ai_addrlen)) break;
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (sockfd < 0 || listen(sockfd, 1)) {
+        PLOG(ERROR) << "Couldn't listen to agent port " << port;
+        return -1;
+    }
+    LOG(INFO) << "Agent waiting for a coordinator on port " << port;
+    int connfd = accept(sockfd, nullptr, 0);
+    close(sockfd);
+    if (connfd < 0) {
+        PLOG(ERROR) << "accept() failed";
+    }
+    return connfd;
+}
+
+// A job is "name=value" flag lines, an empty line and the case lines.
+static int ApplyJob(const std::string &job, std::string *cases) {
+    std::istringstream stream(job);
+    std::string line;
+    while (std::getline(stream, line) && !line.empty()) {
+        auto eq = line.find('=');
+        if (eq == std::string::npos) {
+            LOG(ERROR) << "Bad job line " << line;
+            return -1;
+        }
+        auto name = line.substr(0, eq);
+        if (gflags::SetCommandLineOption(name.c_str(), line.substr(eq + 1).c_str()).empty()) {
+            LOG(ERROR) << "Cannot set flag " << line;
+            return -1;
+        }
+    }
+    std::stringstream rest;
+    rest << stream.rdbuf();
+    *cases = rest.str();
+    return 0;
+}
+
+static int StartServer(htn_context *context) {
+    context->num_of_hosts_ = FLAGS_client_num;
+    if (context->Init()) {
+        LOG(ERROR) << "Server initialization failed!";
+        return -1;
+    }
+    // Both run until the coordinator hangs up and the agent exits.
+    std::thread(&htn_context::Listen, context).detach();
+    std::thread(&htn_context::ServerLaunch, context).detach();
+    return 0;
+}
+
+static int StartClient(htn_context *context) {
+    auto host_list = ParseHost(FLAGS_connect_ip);
+    context->num_of_hosts_ = host_list.size();
+    if (context->Init()) {
+        LOG(ERROR) << "Client initialization failed!";
+        return -1;
+    }
+    for (int i = 0; i < host_list.size(); i++) {
+        if (context->Connect(host_list[i].c_str(), FLAGS_port, i)) {
+            LOG(ERROR) << "Client connect failed!";
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int RunAgent() {
+    int connfd = AcceptCoordinator(FLAGS_agent_port);
+    if (connfd < 0) {
+        return -1;
+    }
+    htn_context *context = nullptr;
+    coord_msg msg;
+    std::string payload;
+    while (!RecvMsg(connfd, &msg, &payload)) {
+        switch (msg.type) {
+            case kSyncKey:
+                msg.timestamp = Now64();
+                SendMsg(connfd, msg);
+                break;
+            case kJobKey: {
+                std::string cases;
+                int status = ApplyJob(payload, &cases);
+                if (!status) {
+                    context = new htn_context();
+                    context->case_text_ = cases;
+                    status = FLAGS_server ? StartServer(context) : StartClient(context);
+                }
+                msg = coord_msg();
+                msg.type = kReadyKey;
+                msg.status = status;
+                SendMsg(connfd, msg);
+                break;
+            }
+            case kStartKey: {
+                if (!context || FLAGS_server) {
+                    break;
+                }
+                // Sleep most of the way, then spin to hit the start instant.
+                for (auto now = Now64(); now < msg.timestamp; now = Now64()) {
+                    if (msg.timestamp - now > 2000) {
+                        usleep(msg.timestamp - now - 1000);
+                    }
+                }
+                context->report_fd_ = connfd;
+                context->ClientLaunch();
+                close(connfd);
+                return 0;
+            }
+            default:
+                LOG(ERROR) << "Unknown coordinator message " << msg.type;
+                break;
+        }
+    }
+    // The coordinator hung up, the run is over.
+    close(connfd);
+    return 0;
+}
+
+// Estimate the agent's clock offset from the exchange with the smallest round
+// trip, assuming the agent read its clock half way through.
+static int SyncClock(agent_link *agent) {
+    uint64_t best_rtt = UINT64_MAX;
+    for (int i = 0; i < kSyncRounds; i++) {
+        coord_msg msg = coord_msg();
+        msg.type = kSyncKey;
+        auto sent = Now64();
+        if (SendMsg(agent->fd, msg) || RecvMsg(agent->fd, &msg) || msg.type != kSyncKey) {
+            return -1;
+        }
+        auto rtt = Now64() - sent;
+        if (rtt < best_rtt) {
+            best_rtt = rtt;
+            agent->offset = (int64_t)msg.timestamp - (int64_t)(sent + rtt / 2);
+        }
+    }
+    LOG(INFO) << "Agent " << agent->host << " clock offset " << agent->offset
+            << " us, rtt " << best_rtt << " us";
+    return 0;
+}
+
+// Flags every agent runs with: the role, the run control of the coordinator
+// and --agent_flags.
+static std::string JobFlags(bool server, int client_num) {
+    std::stringstream job;
+    job << "server=" << (server ? "true" : "false") << "\n";
+    if (server) {
+        job << "client_num=" << client_num << "\n";
+    } else {
+        job << "connect_ip="
+            << (FLAGS_server_agent.empty() ? FLAGS_connect_ip : FLAGS_server_agent) << "\n";
+    }
+    for (auto name : {"port", "warmup", "duration", "stats_interval_ms", "steady_cv",
+                      "steady_window", "steady_timeout"}) {
+        std::string value;
+        if (gflags::GetCommandLineOption(name, &value)) {
+            job << name << "=" << value << "\n";
+        }
+    }
+    std::istringstream extra(FLAGS_agent_flags);
+    std::string token;
+    while (extra >> token) {
+        token = token.substr(token.find_first_not_of('-'));
+        job << token << (token.find('=') == std::string::npos ? "=true" : "") << "\n";
+    }
+    job << "\n";
+    return job.str();
+}
+
+static int StartAgent(agent_link *agent, bool server, int client_num) {
+    agent->fd = TcpConnect(agent->host.c_str(), FLAGS_agent_port);
+    if (agent->fd < 0 || SyncClock(agent)) {
+        LOG(ERROR) << "Cannot reach agent " << agent->host;
+        return -1;
+    }
+    coord_msg msg = coord_msg();
+    msg.type = kJobKey;
+    if (SendMsg(agent->fd, msg, JobFlags(server, client_num) + agent->cases) ||
+        RecvMsg(agent->fd, &msg) || msg.type != kReadyKey || msg.status) {
+        LOG(ERROR) << "Agent " << agent->host << " failed to set up its job";
+        return -1;
+    }
+    LOG(INFO) << "Agent " << agent->host << " ready";
+    return 0;
+}
+
+// Print every interval all running agents have reported, rates of the same
+// interval side by side and the spread of their end times.
+static void PrintIntervals(std::vector<agent_link> &agents, size_t *printed) {
+    while (1) {
+        bool any = false;
+        for (auto &agent : agents) {
+            if (agent.reports.size() > *printed) {
+                any = true;
+            } else if (!agent.finished && !agent.lost) {
+                return;
+            }
+        }
+        if (!any) {
+            return;
+        }
+        double gbps = 0, mrps = 0;
+        uint64_t errors = 0;
+        int64_t first = INT64_MAX, last = INT64_MIN;
+        int phase = kPhaseDone;
+        std::stringstream per_agent;
+        for (auto &agent : agents) {
+            if (agent.reports.size() <= *printed) {
+                continue;
+            }
+            auto &r = agent.reports[*printed];
+            auto agent_gbps = r.duration ? r.bytes * 8.0 / r.duration / 1000.0 : 0;
+            gbps += agent_gbps;
+            mrps += r.duration ? r.msgs * 1.0 / r.duration : 0;
+            errors += r.errors;
+            int64_t end = (int64_t)r.timestamp - agent.offset;
+            first = std::min(first, end);
+            last = std::max(last, end);
+            phase = std::min(phase, r.phase);
+            per_agent << " " << agent.host << "=" << agent_gbps;
+        }
+        LOG(INFO) << "interval " << *printed << " phase " << phase << " total Rate="
+                << gbps << " Gbps, " << mrps << " Mrps, errors +" << errors
+                << ", skew " << last - first << " us, Gbps" << per_agent.str();
+        (*printed)++;
+    }
+}
+
+int RunCoordinator() {
+    if (FLAGS_duration <= 0) {
+        LOG(ERROR) << "Coordinator mode needs --duration";
+        return -1;
+    }
+    std::vector<std::string> lines;
+    std::ifstream test_file("test_case_demo");
+    std::string line;
+    while (std::getline(test_file, line)) {
+        if (line.find_first_not_of(" \t\r") != std::string::npos) {
+            lines.push_back(line);
+        }
+    }
+    std::vector<agent_link> agents;
+    for (auto &host : ParseHost(FLAGS_agents)) {
+        if (!host.empty()) {
+            agent_link agent;
+            agent.host = host;
+            agents.push_back(agent);
+        }
+    }
+    if (lines.empty() || agents.empty()) {
+        LOG(ERROR) << "Coordinator needs case lines and --agents";
+        return -1;
+    }
+    // Lines are dealt round-robin. With fewer lines than agents every agent
+    // repeats one, e.g. a single line makes an N-to-1 incast.
+    int n = agents.size();
+    for (int i = 0; i < n; i++) {
+        if (lines.size() >= n) {
+            for (int j = i; j < lines.size(); j += n) {
+                agents[i].cases += lines[j] + "\n";
+            }
+        } else {
+            agents[i].cases = lines[i % lines.size()] + "\n";
+        }
+    }
+    // The server hands out its endpoints in connection order, so its case is
+    // the concatenation of the slices, read as one host, and the clients
+    // connect one by one.
+    agent_link server;
+    if (!FLAGS_server_agent.empty()) {
+        server.host = FLAGS_server_agent;
+        for (auto &agent : agents) {
+            server.cases += agent.cases;
+        }
+        if (StartAgent(&server, true, 1)) {
+            return -1;
+        }
+    }
+    for (auto &agent : agents) {
+        if (StartAgent(&agent, false, 0)) {
+            return -1;
+        }
+    }
+    // Start barrier: everybody is connected, release them at one instant.
+    auto start = Now64() + FLAGS_start_delay_ms * 1000ull;
+    for (auto &agent : agents) {
+        coord_msg msg = coord_msg();
+        msg.type = kStartKey;
+        msg.timestamp = start + agent.offset;
+        if (SendMsg(agent.fd, msg)) {
+            LOG(ERROR) << "Cannot start agent " << agent.host;
+            return -1;
+        }
+    }
+    LOG(INFO) << "Started " << n << " agents at " << start;
+
+    std::vector<struct pollfd> fds(n);
+    for (int i = 0; i < n; i++) {
+        fds[i].fd = agents[i].fd;
+        fds[i].events = POLLIN;
+    }
+    int running = n;
+    size_t printed = 0;
+    while (running > 0) {
+        if (poll(fds.data(), n, -1) < 0) {
+            PLOG(ERROR) << "poll() failed";
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            auto &agent = agents[i];
+            coord_msg msg;
+            if (RecvMsg(agent.fd, &msg)) {
+                LOG(ERROR) << "Lost agent " << agent.host;
+                agent.lost = true;
+            } else if (msg.type == kReportKey) {
+                agent.reports.push_back(msg);
+                continue;
+            } else if (msg.type == kDoneKey) {
+                agent.done = msg;
+                agent.finished = true;
+            } else {
+                continue;
+            }
+            fds[i].fd = -1;
+            running--;
+        }
+        PrintIntervals(agents, &printed);
+    }
+
+    double gbps = 0, mrps = 0, min_gbps = 0, max_gbps = 0;
+    uint64_t errors = 0;
+    int64_t first = INT64_MAX, last = INT64_MIN;
+    int done = 0;
+    for (auto &agent : agents) {
+        if (!agent.finished) {
+            continue;
+        }
+        auto &d = agent.done;
+        auto agent_gbps = d.duration ? d.bytes * 8.0 / d.duration / 1000.0 : 0;
+        LOG(INFO) << "agent " << agent.host << " Rate=" << agent_gbps << " Gbps, "
+                << (d.duration ? d.msgs * 1.0 / d.duration : 0) << " Mrps, errors "
+                << d.errors;
+        min_gbps = done ? std::min(min_gbps, agent_gbps) : agent_gbps;
+        max_gbps = done ? std::max(max_gbps, agent_gbps) : agent_gbps;
+        gbps += agent_gbps;
+        mrps += d.duration ? d.msgs * 1.0 / d.duration : 0;
+        errors += d.errors;
+        // Launch times mapped to the coordinator clock
+        int64_t launched = (int64_t)d.timestamp - agent.offset;
+        first = std::min(first, launched);
+        last = std::max(last, launched);
+        done++;
+    }
+    LOG(INFO) << "COORD SUMMARY agents=" << done << "/" << n << " gbps=" << gbps
+            << " mrps=" << mrps << " errors=" << errors << " min_agent_gbps=" << min_gbps
+            << " max_agent_gbps=" << max_gbps
+            << " start_skew_us=" << (done ? last - first : 0);
+    for (auto &agent : agents) {
+        close(agent.fd);
+    }
+    if (server.fd >= 0) {
+        close(server.fd);
+    }
+    return done == n ? 0 : -1;
+}
+
+}
@@ -0,0 +1,50 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef HTN_COORD_HH
+#define HTN_COORD_HH
+
+#include <string>
+#include <vector>
+
+#include "htn_helper.hh"
+
+namespace Htn {
+
+// Coordinator <-> agent messages, exchanged on --agent_port. The keys do not
+// overlap the connection setup keys of connect_info.
+constexpr int kJobKey = 16;     // flags and case slice, as payload
+constexpr int kSyncKey = 17;    // clock offset probe
+constexpr int kReadyKey = 18;   // agent connected its QPs
+constexpr int kStartKey = 19;   // start at timestamp, agent clock
+constexpr int kReportKey = 20;  // one stats interval
+constexpr int kDoneKey = 21;    // measured window
+constexpr int kSyncRounds = 8;
+
+struct coord_msg {
+    int type;
+    int status;     // 0 on success
+    int phase;      // htn_phase of a report
+    uint32_t len;   // bytes of payload following the message
+    uint64_t timestamp;
+    uint64_t duration;  // us covered by bytes/msgs/errors
+    uint64_t bytes;
+    uint64_t msgs;
+    uint64_t errors;
+};
+
+int SendMsg(int fd, const coord_msg &msg, const std::string &payload = "");
+int RecvMsg(int fd, coord_msg *msg, std::string *payload = nullptr);
+
+// One controller process hands case slices to agent engines, starts them at
+// the same instant and merges their stats streams.
+int RunCoordinator();
+int RunAgent();
+
+}
+
+#endif
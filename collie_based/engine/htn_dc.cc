@@ -0,0 +1,211 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "htn_dc.hh"
+#include "htn_device.hh"
+
+namespace Htn {
+
+static struct ibv_qp *CreateDci(struct ibv_context *ctx, struct ibv_pd *pd,
+                                struct ibv_cq *cq, int depth) {
+    struct ibv_qp_init_attr_ex attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_type = IBV_QPT_DRIVER;
+    attr.send_cq = cq;
+    attr.recv_cq = cq;
+    attr.cap.max_send_wr = depth;
+    attr.cap.max_send_sge = 1;
+    attr.cap.max_inline_data = FLAGS_max_inline;
+    attr.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+    attr.pd = pd;
+    attr.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_READ;
+    struct mlx5dv_qp_init_attr dv_attr;
+    memset(&dv_attr, 0, sizeof(dv_attr));
+    dv_attr.comp_mask = MLX5DV_QP_INIT_ATTR_MASK_DC;
+    dv_attr.dc_init_attr.dc_type = MLX5DV_DCTYPE_DCI;
+    return mlx5dv_create_qp(ctx, &attr, &dv_attr);
+}
+
+// RESET -> INIT -> RTR -> RTS. The address vector is given per request, the
+// one of RTR only selects the port and source GID.
+static int ConnectDci(struct ibv_qp *dci, const union ibv_gid &gid, int port_num) {
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = port_num;
+    if (ibv_modify_qp(dci, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT)) {
+        PLOG(ERROR) << "Failed to modify DCI to INIT";
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = (enum ibv_mtu)FLAGS_mtu;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.sgid_index = FLAGS_gid;
+    attr.ah_attr.grh.hop_limit = FLAGS_hop_limit;
+    attr.ah_attr.grh.traffic_class = FLAGS_tos;
+    memcpy(&attr.ah_attr.grh.dgid, &gid, sizeof(union ibv_gid));
+    attr.ah_attr.port_num = port_num;
+    if (ibv_modify_qp(dci, &attr, IBV_QP_STATE | IBV_QP_PATH_MTU | IBV_QP_AV)) {
+        PLOG(ERROR) << "Failed to modify DCI to RTR";
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.timeout = FLAGS_qp_timeout;
+    attr.retry_cnt = FLAGS_retry_cnt;
+    attr.rnr_retry = FLAGS_rnr_retry;
+    attr.sq_psn = 0;
+    attr.max_rd_atomic = FLAGS_max_qp_rd_atom;
+    if (ibv_modify_qp(dci, &attr, IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+                                  IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC)) {
+        PLOG(ERROR) << "Failed to modify DCI to RTS";
+        return -1;
+    }
+    return 0;
+}
+
+int htn_dci_pool::Init(htn_device *device, struct ibv_pd *pd, int num, int depth,
+                       const std::string &policy) {
+    if (policy == "hash") {
+        policy_ = kDciHash;
+    } else if (policy == "rr") {
+        policy_ = kDciRoundRobin;
+    } else if (policy == "lru") {
+        policy_ = kDciLru;
+    } else {
+        LOG(ERROR) << "Unknown --dci_policy " << policy;
+        return -1;
+    }
+    // Completions of the DCIs wake the datapath thread like those of its QPs.
+    cq_ = ibv_create_cq(device->ctx_, num * depth, nullptr, device->channel_, 0);
+    if (!cq_) {
+        PLOG(ERROR) << "ibv_create_cq() failed for the DCI pool of " << device->GetName();
+        return -1;
+    }
+    for (int i = 0; i < num; i++) {
+        htn_dci dci;
+        dci.qp = CreateDci(device->ctx_, pd, cq_, depth);
+        if (!dci.qp) {
+            PLOG(ERROR) << "Cannot create DCI " << i << " on " << device->GetName();
+            return -1;
+        }
+        if (ConnectDci(dci.qp, device->gid_, device->port_num_)) {
+            return -1;
+        }
+        dci.qpx = ibv_qp_to_qp_ex(dci.qp);
+        dci.mqpx = mlx5dv_qp_ex_from_ibv_qp_ex(dci.qpx);
+        dci.credits = depth;
+        by_qpn_[dci.qp->qp_num] = dcis_.size();
+        dcis_.push_back(dci);
+    }
+    LOG(INFO) << "dev " << device->GetName() << ": " << num << " DCIs, policy " << policy;
+    return 0;
+}
+
+int htn_dci_pool::Pick(uint32_t flow, const void *ah, uint32_t dctn, uint32_t batch) {
+    int n = dcis_.size();
+    int pick = -1;
+    switch (policy_) {
+        case kDciHash:
+            pick = flow % n;
+            if (dcis_[pick].credits < batch) {
+                pick = -1;
+            }
+            break;
+        case kDciRoundRobin:
+            for (int k = 0; k < n; k++) {
+                int d = (rr_ + k) % n;
+                if (dcis_[d].credits >= batch) {
+                    pick = d;
+                    rr_ = d + 1;
+                    break;
+                }
+            }
+            break;
+        case kDciLru:
+            for (int d = 0; d < n; d++) {
+                auto &dci = dcis_[d];
+                if (dci.credits < batch) {
+                    continue;
+                }
+                if (dci.dctn == dctn && dci.ah == ah) {
+                    pick = d;
+                    break;
+                }
+                if (pick < 0 || dci.last_use < dcis_[pick].last_use) {
+                    pick = d;
+                }
+            }
+            break;
+    }
+    if (pick < 0) {
+        return -1;
+    }
+    auto &dci = dcis_[pick];
+    if (dci.ah && (dci.dctn != dctn || dci.ah != ah)) {
+        reconnects_++;
+    }
+    dci.dctn = dctn;
+    dci.ah = ah;
+    dci.last_use = ++clock_;
+    batches_++;
+    return pick;
+}
+
+struct ibv_qp *CreateDct(struct ibv_context *ctx, struct ibv_pd *pd, struct ibv_cq *cq,
+                         struct ibv_srq *srq) {
+    struct ibv_qp_init_attr_ex attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_type = IBV_QPT_DRIVER;
+    attr.send_cq = cq;
+    attr.recv_cq = cq;
+    attr.srq = srq;
+    attr.comp_mask = IBV_QP_INIT_ATTR_PD;
+    attr.pd = pd;
+    struct mlx5dv_qp_init_attr dv_attr;
+    memset(&dv_attr, 0, sizeof(dv_attr));
+    dv_attr.comp_mask = MLX5DV_QP_INIT_ATTR_MASK_DC;
+    dv_attr.dc_init_attr.dc_type = MLX5DV_DCTYPE_DCT;
+    dv_attr.dc_init_attr.dct_access_key = kDcAccessKey;
+    return mlx5dv_create_qp(ctx, &attr, &dv_attr);
+}
+
+// RESET -> INIT -> RTR, a DCT never sends.
+int ConnectDct(struct ibv_qp *dct, int port_num, int tc, int sl) {
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = port_num;
+    attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_ATOMIC;
+    if (ibv_modify_qp(dct, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
+                                  IBV_QP_ACCESS_FLAGS)) {
+        PLOG(ERROR) << "Failed to modify DCT to INIT";
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = (enum ibv_mtu)FLAGS_mtu;
+    attr.min_rnr_timer = FLAGS_min_rnr_timer;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.sgid_index = FLAGS_gid;
+    attr.ah_attr.grh.hop_limit = FLAGS_hop_limit;
+    attr.ah_attr.grh.traffic_class = tc;
+    attr.ah_attr.sl = sl;
+    attr.ah_attr.port_num = port_num;
+    if (ibv_modify_qp(dct, &attr, IBV_QP_STATE | IBV_QP_MIN_RNR_TIMER | IBV_QP_AV |
+                                  IBV_QP_PATH_MTU)) {
+        PLOG(ERROR) << "Failed to modify DCT to RTR";
+        return -1;
+    }
+    return 0;
+}
+
+}
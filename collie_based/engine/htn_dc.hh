@@ -0,0 +1,75 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+// Dynamically connected transport (mlx5dv). A case line with service_type
+// kQptDc makes the server create one DCT per endpoint; client endpoints are
+// logical flows without a QP of their own, every batch of a flow goes out on
+// a DCI of the device's pool picked by --dci_policy.
+
+#ifndef HTN_DC_HH
+#define HTN_DC_HH
+
+#include <unordered_map>
+#include <vector>
+
+#include "htn_helper.hh"
+
+namespace Htn {
+
+class htn_device;
+
+struct htn_dci {
+    struct ibv_qp *qp = nullptr;
+    struct ibv_qp_ex *qpx = nullptr;
+    struct mlx5dv_qp_ex *mqpx = nullptr;
+    uint32_t credits = 0;       // free send queue entries
+    uint32_t dctn = 0;          // target of the last request
+    const void *ah = nullptr;   // address handle of that target
+    uint64_t last_use = 0;
+};
+
+enum htn_dci_policy {
+    kDciHash = 0,  // flow id modulo the pool size
+    kDciRoundRobin,
+    kDciLru,       // a DCI already on the target, else the least recently used
+};
+
+class htn_dci_pool {
+public:
+    std::vector<htn_dci> dcis_;
+    struct ibv_cq *cq_ = nullptr;  // completions of all DCIs
+    int policy_ = kDciHash;
+    uint32_t rr_ = 0;
+    uint64_t clock_ = 0;
+    std::unordered_map<uint32_t, int> by_qpn_;
+    // Flows that found no DCI with room, retried when credits come back
+    std::vector<int> waiting_;
+
+    // Statistics, only touched by the device's datapath thread
+    uint64_t batches_ = 0;
+    uint64_t reconnects_ = 0;  // batches sent to another target than the DCI's last one
+    uint64_t stats_batches_ = 0;
+    uint64_t stats_reconnects_ = 0;
+
+    // Create and connect `num` DCIs of `depth` send queue entries
+    int Init(htn_device *device, struct ibv_pd *pd, int num, int depth,
+             const std::string &policy);
+    // DCI for a batch of `batch` requests of `flow` to (ah, dctn), -1 if
+    // none has room
+    int Pick(uint32_t flow, const void *ah, uint32_t dctn, uint32_t batch);
+    int Of(uint32_t qpn) { return by_qpn_[qpn]; }
+};
+
+// A DCT in `pd` ready to be targeted; DCTs need an SRQ even when only
+// one-sided requests reach them.
+struct ibv_qp *CreateDct(struct ibv_context *ctx, struct ibv_pd *pd, struct ibv_cq *cq,
+                         struct ibv_srq *srq);
+int ConnectDct(struct ibv_qp *dct, int port_num, int tc, int sl);
+
+}
+
+#endif
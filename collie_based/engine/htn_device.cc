@@ -0,0 +1,299 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "htn_device.hh"
+#include "htn_memory.hh"
+#include "htn_srq.hh"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace Htn {
+
+// Parse a sysfs cpulist such as "0-15,32-47"
+static int ParseCpuList(const std::string &list, std::vector<int> *cpus) {
+    for (auto &range : ParseHost(list)) {
+        if (range.empty()) {
+            continue;
+        }
+        char *end = nullptr;
+        long first = strtol(range.c_str(), &end, 10);
+        long last = first;
+        bool ok = end != range.c_str();
+        if (ok && *end == '-') {
+            auto second = end + 1;
+            last = strtol(second, &end, 10);
+            ok = end != second;
+        }
+        if (!ok || *end || first < 0 || last < first) {
+            LOG(ERROR) << "Bad CPU range " << range << " in " << list;
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus->push_back(cpu);
+        }
+    }
+    return 0;
+}
+
+int htn_device::Open(struct ibv_device *dev) {
+    ctx_ = ibv_open_device(dev);
+    if (!ctx_) {
+        LOG(ERROR) << "cannot open device " << name_;
+        return -1;
+    }
+    if (CheckOdpCaps(ctx_)) {
+        return -1;
+    }
+    struct ibv_port_attr port_attr;
+    if (ibv_query_port(ctx_, port_num_, &port_attr)) {
+        PLOG(ERROR) << "ibv_query_port() failed on " << GetName();
+        return -1;
+    }
+    lid_ = port_attr.lid;
+    struct ibv_device_attr dev_attr;
+    if (ibv_query_device(ctx_, &dev_attr) == 0) {
+        max_init_rd_atom_ = dev_attr.max_qp_init_rd_atom;
+        max_rd_atom_ = dev_attr.max_qp_rd_atom;
+    }
+    if (ibv_query_gid(ctx_, port_num_, FLAGS_gid, &gid_)) {
+        PLOG(ERROR) << "ibv_query_gid() failed on " << GetName();
+        return -1;
+    }
+    std::string sysfs = "/sys/class/infiniband/" + name_ + "/device/";
+    std::ifstream numa_file(sysfs + "numa_node");
+    if (!(numa_file >> numa_)) {
+        numa_ = -1;
+    }
+    std::ifstream cpu_file(sysfs + "local_cpulist");
+    std::string cpu_list;
+    if (std::getline(cpu_file, cpu_list) && ParseCpuList(cpu_list, &cpus_)) {
+        return -1;
+    }
+    LOG(INFO) << "Opened " << GetName() << " lid " << lid_ << " numa " << numa_
+            << " local cores " << cpus_.size();
+    return 0;
+}
+
+struct ibv_srq *htn_device::DctSrq(struct ibv_pd *pd) {
+    auto &srq = dct_srqs_[pd];
+    if (!srq) {
+        struct ibv_srq_init_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.attr.max_wr = 1;
+        attr.attr.max_sge = 1;
+        srq = ibv_create_srq(pd, &attr);
+        if (!srq) {
+            PLOG(ERROR) << "ibv_create_srq() failed on " << GetName();
+        }
+    }
+    return srq;
+}
+
+htn_prio_class *htn_device::Class(int prio, int tc, int sl) {
+    auto it = classes_.begin();
+    for (; it != classes_.end(); ++it) {
+        auto c = *it;
+        if (c->prio == prio && c->tc == tc && c->sl == sl) {
+            return c;
+        }
+        if (c->prio < prio) {
+            break;
+        }
+    }
+    auto c = new htn_prio_class();
+    c->prio = prio;
+    c->tc = tc;
+    c->sl = sl;
+    classes_.insert(it, c);
+    return c;
+}
+
+htn_srq *htn_device::Srq(struct ibv_pd *pd, bool xrc) {
+    auto &srq = srqs_[pd];
+    if (srq) {
+        return srq;
+    }
+    if (xrc && !xrcd_) {
+        struct ibv_xrcd_init_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.comp_mask = IBV_XRCD_INIT_ATTR_FD | IBV_XRCD_INIT_ATTR_OFLAGS;
+        attr.fd = -1;  // a domain of this process only
+        attr.oflags = O_CREAT;
+        xrcd_ = ibv_open_xrcd(ctx_, &attr);
+        if (!xrcd_) {
+            PLOG(ERROR) << "ibv_open_xrcd() failed on " << GetName();
+            return nullptr;
+        }
+    }
+    srq = new htn_srq();
+    if (srq->Init(this, pd, xrc ? xrcd_ : nullptr, FLAGS_srq_depth)) {
+        delete srq;
+        srq = nullptr;
+    }
+    return srq;
+}
+
+int htn_device::OpenChannel() {
+    channel_ = ibv_create_comp_channel(ctx_);
+    if (!channel_) {
+        PLOG(ERROR) << "ibv_create_comp_channel() failed on " << GetName();
+        return -1;
+    }
+    int flags = fcntl(channel_->fd, F_GETFL);
+    if (fcntl(channel_->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        PLOG(ERROR) << "Cannot make the completion channel non-blocking";
+        return -1;
+    }
+    epfd_ = epoll_create1(0);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = channel_;
+    if (epfd_ < 0 || epoll_ctl(epfd_, EPOLL_CTL_ADD, channel_->fd, &ev)) {
+        PLOG(ERROR) << "epoll setup failed on " << GetName();
+        return -1;
+    }
+    return 0;
+}
+
+int htn_device::WaitEvents(int timeout_ms) {
+    struct epoll_event ev;
+    int n = epoll_wait(epfd_, &ev, 1, timeout_ms);
+    if (n <= 0) {
+        return n;
+    }
+    wakeups_++;
+    struct ibv_cq *cq;
+    void *cq_ctx;
+    int events = 0;
+    while (!ibv_get_cq_event(channel_, &cq, &cq_ctx)) {
+        ibv_ack_cq_events(cq, 1);
+        events++;
+    }
+    // Fired CQs are re-armed before the next sleep.
+    armed_ = false;
+    return events;
+}
+
+uint64_t htn_device::ThreadCpuUs() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+int htn_device::BindCpus() {
+    if (cpus_.empty()) {
+        return 0;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus_) {
+        CPU_SET(cpu, &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        LOG(WARNING) << "Cannot bind thread to the cores of " << GetName();
+        return -1;
+    }
+    return 0;
+}
+
+static std::vector<std::string> ListDir(const std::string &path) {
+    std::vector<std::string> names;
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+        return names;
+    }
+    while (auto entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    return names;
+}
+
+int OpenPortCounters(const std::string &dev, int port_num, const std::string &names,
+                     std::vector<hw_counter> *counters) {
+    std::string port = "/sys/class/infiniband/" + dev + "/ports/" + std::to_string(port_num);
+    // Driver counters first, they hold the error and congestion events.
+    std::vector<std::string> dirs = {port + "/hw_counters/", port + "/counters/"};
+    std::vector<std::string> wanted;
+    if (names == "all") {
+        for (auto &dir : dirs) {
+            for (auto &name : ListDir(dir)) {
+                wanted.push_back(name);
+            }
+        }
+    } else {
+        wanted = ParseHost(names);
+    }
+    for (auto &name : wanted) {
+        if (name.empty()) {
+            continue;
+        }
+        bool dup = false;
+        for (auto &counter : *counters) {
+            dup |= counter.name == name;
+        }
+        if (dup) {
+            continue;
+        }
+        int fd = -1;
+        for (auto &dir : dirs) {
+            fd = open((dir + name).c_str(), O_RDONLY);
+            if (fd >= 0) {
+                break;
+            }
+        }
+        if (fd < 0) {
+            LOG(WARNING) << "No port counter " << name << " on " << dev << ":" << port_num;
+            continue;
+        }
+        hw_counter counter;
+        counter.name = name;
+        counter.fd = fd;
+        counters->push_back(counter);
+    }
+    std::vector<uint64_t> delta;
+    ReadPortCounters(counters, &delta);
+    return counters->empty() ? -1 : 0;
+}
+
+void ReadPortCounters(std::vector<hw_counter> *counters, std::vector<uint64_t> *delta) {
+    delta->assign(counters->size(), 0);
+    char buf[32];
+    for (int i = 0; i < counters->size(); i++) {
+        auto &counter = (*counters)[i];
+        auto len = pread(counter.fd, buf, sizeof(buf) - 1, 0);
+        if (len <= 0) {
+            continue;
+        }
+        buf[len] = 0;
+        uint64_t value = strtoull(buf, nullptr, 10);
+        // 32-bit IB counters saturate or get reset, never report those as a
+        // huge increase.
+        (*delta)[i] = value >= counter.last ? value - counter.last : 0;
+        counter.last = value;
+    }
+}
+
+int htn_device::OpenHwCounters(const std::string &names) {
+    return OpenPortCounters(name_, port_num_, names, &hw_counters_);
+}
+
+void htn_device::ReadHwCounters(std::vector<uint64_t> *delta) {
+    ReadPortCounters(&hw_counters_, delta);
+}
+
+}
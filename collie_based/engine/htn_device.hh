@@ -0,0 +1,133 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef HTN_DEVICE_HH
+#define HTN_DEVICE_HH
+
+#include <map>
+#include <vector>
+
+#include "htn_helper.hh"
+#include "htn_stats.hh"
+
+namespace Htn {
+
+class htn_dci_pool;
+class htn_srq;
+class htn_cc_counters;
+
+// A port counter file in sysfs, kept open and re-read with pread()
+struct hw_counter {
+    std::string name;
+    int fd = -1;
+    uint64_t last = 0;
+};
+
+// Open the comma separated counters in `names` of a port, or all of them for
+// "all", looking in hw_counters/ first and then counters/
+int OpenPortCounters(const std::string &dev, int port_num, const std::string &names,
+                     std::vector<hw_counter> *counters);
+// Increase of every counter since the previous call
+void ReadPortCounters(std::vector<hw_counter> *counters, std::vector<uint64_t> *delta);
+
+// Endpoints of a device sharing traffic class, service level and expected
+// priority (case options tc=, sl=, prio=)
+struct htn_prio_class {
+    int prio = 0;
+    int tc = 0;
+    int sl = 0;
+    std::vector<int> endpoint_ids;
+    htn_histogram batch_lat;
+    uint64_t stats_bytes = 0;
+    uint64_t stats_msgs = 0;
+    uint64_t inversions = 0;  // intervals its p99 exceeded a lower class's
+};
+
+// One RDMA device port driven by the engine. Each device owns its PDs, and
+// the endpoints placed on it are served by a datapath thread bound to the
+// device's local cores.
+class htn_device {
+public:
+    std::string name_;
+    int port_num_ = 1;
+    struct ibv_context *ctx_ = nullptr;
+    union ibv_gid gid_;
+    uint16_t lid_ = 0;
+    // READ limits of the device: initiator and responder side per QP
+    int max_init_rd_atom_ = 255;
+    int max_rd_atom_ = 255;
+    int numa_ = -1;
+    std::vector<int> cpus_;  // cores local to the device
+    std::vector<struct ibv_pd *> pds_;
+    std::vector<int> endpoint_ids_;
+    // DC: the DCIs the client flows share, the SRQs server DCTs need
+    htn_dci_pool *dci_pool_ = nullptr;
+    std::map<struct ibv_pd *, struct ibv_srq *> dct_srqs_;
+    // --recv_topology=srq/xrc: the SRQ of each server PD, XRC ones in xrcd_
+    std::map<struct ibv_pd *, htn_srq *> srqs_;
+    struct ibv_xrcd *xrcd_ = nullptr;
+    // Endpoints with signaled sends in flight, bit i stands for
+    // endpoint_ids_[i]. The client loop only polls the send CQs set here.
+    std::vector<uint64_t> active_;
+    uint64_t polls_ = 0;
+    // Endpoints (slots) waiting for the --post_coalesce_us flush, queued
+    // since ready_ts_
+    std::vector<int> ready_;
+    uint64_t ready_ts_ = 0;
+
+    // Completion channel of --cq_mode=event/hybrid, every CQ of the device
+    // reports to it and the datapath thread sleeps on it with epoll
+    struct ibv_comp_channel *channel_ = nullptr;
+    int epfd_ = -1;
+    bool armed_ = false;
+    uint64_t wakeups_ = 0;
+
+    // Statistics, only touched by the device's datapath thread
+    htn_histogram batch_lat_;
+    std::vector<htn_prio_class *> classes_;  // highest priority first
+    uint64_t stats_ts_ = 0;
+    uint64_t stats_bytes_ = 0;
+    uint64_t stats_msgs_ = 0;
+    uint64_t stats_cpu_us_ = 0;
+    uint64_t stats_wakeups_ = 0;
+    uint64_t stats_polls_ = 0;
+
+    // Port counters (counters/ and hw_counters/ in sysfs), read by the
+    // sampler thread only
+    std::vector<hw_counter> hw_counters_;
+    // --cc_stats and the netdev --cc_profile applies to
+    htn_cc_counters *cc_ = nullptr;
+
+    htn_device(const std::string &name, int port_num)
+        : name_(name), port_num_(port_num) {}
+
+    int Open(struct ibv_device *dev);
+    void SetActive(int slot) { active_[slot >> 6] |= 1ull << (slot & 63); }
+    void ClearActive(int slot) { active_[slot >> 6] &= ~(1ull << (slot & 63)); }
+    // Bind the calling thread to the device's local cores
+    int BindCpus();
+    int OpenChannel();
+    // SRQ of the DCTs in `pd`, created on first use
+    struct ibv_srq *DctSrq(struct ibv_pd *pd);
+    // Priority class of (prio, tc, sl), created on first use
+    htn_prio_class *Class(int prio, int tc, int sl);
+    // SRQ of the receive topology in `pd`, created and filled on first use
+    htn_srq *Srq(struct ibv_pd *pd, bool xrc);
+    // Sleep up to timeout_ms for a completion event and consume the events
+    int WaitEvents(int timeout_ms);
+    // CPU time of the calling thread
+    static uint64_t ThreadCpuUs();
+    // Open the comma separated counters in `names`, or all of them for "all"
+    int OpenHwCounters(const std::string &names);
+    // Increase of every counter since the previous call
+    void ReadHwCounters(std::vector<uint64_t> *delta);
+    std::string GetName() { return name_ + ":" + std::to_string(port_num_); }
+};
+
+}
+
+#endif
@@ -10,52 +10,90 @@
 
 namespace Htn {
 
-// todo: pick out WQE generation
-int htn_endpoint::PostSend(std::vector<htn_region *> &mem_pool, test_qp qp_case,
-                            const std::vector<htn_buffer *> &remote_buffer) {
-    // todo: static WQE
+// Post kernel of any case: mixed opcodes, immediate data and --verify.
+int htn_endpoint::PostGeneric(std::vector<htn_region *> &mem_pool,
+                              const std::vector<htn_buffer *> &remote_buffer) {
+    const test_qp &qp_case = post_case_;
     struct ibv_send_wr wr_list[kMaxBatch];
-    uint32_t batch_size = qp_case.write_num + qp_case.read_num + qp_case.send_recv_num;
+    uint32_t batch_size = qp_case.write_num + qp_case.read_num + qp_case.send_recv_num +
+                          qp_case.write_imm_num + qp_case.send_imm_num;
     int remote_buf_idx = 0;
     int finish_wr_num = 0;
     int finish_rd_num = 0;
     int finish_sr_num = 0;
+    int finish_wi_num = 0;
+    int finish_si_num = 0;
     int rbuf_idx = 0;
-    struct ibv_sge sge;
+    uint64_t now = 0;
+    struct ibv_sge sge[kMaxBatch];
+    if (qp_case.write_imm_num || qp_case.send_imm_num) {
+        now = Now64();
+    }
     // htn_buffer *buffer;
     for (int i = 0; i < batch_size; i++) {
         wr_list[i].num_sge = 1; // todo
         for (int j = 0; j < wr_list[i].num_sge; j++) {
 
         }
-        // buffer = mem_pool[0]->buffers_.front();
-        sge.addr = mem_pool[0]->buffers_.front()->addr_;
-        sge.lkey = mem_pool[0]->buffers_.front()->local_key_;
-        sge.length = qp_case.data_size;
-        bytes_sent_now_ += sge.length;
-        msgs_sent_now_++;
         if (finish_wr_num < qp_case.write_num) {
             wr_list[i].opcode = IBV_WR_RDMA_WRITE;
+            finish_wr_num++;
         }
         else if (finish_rd_num < qp_case.read_num) {
             wr_list[i].opcode = IBV_WR_RDMA_READ;
+            finish_rd_num++;
         }
         else if (finish_sr_num < qp_case.send_recv_num) {
             wr_list[i].opcode = IBV_WR_SEND;
+            finish_sr_num++;
+        }
+        else if (finish_wi_num < qp_case.write_imm_num) {
+            wr_list[i].opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+            finish_wi_num++;
+        }
+        else if (finish_si_num < qp_case.send_imm_num) {
+            wr_list[i].opcode = IBV_WR_SEND_WITH_IMM;
+            finish_si_num++;
         }
         else {
             LOG(ERROR) << "Insufficient case!";
         }
+        if (verify_send_) {
+            uint32_t slot = verify_send_idx_++ % verify_send_->num_;
+            auto buf = (char *)verify_send_->addr_ + (uint64_t)slot * verify_send_->size_;
+            sge[i].addr = (uint64_t)buf;
+            sge[i].lkey = verify_send_->mr_->lkey;
+            // The receiver matches SEND payloads against its own receive count.
+            switch (wr_list[i].opcode) {
+                case IBV_WR_SEND:
+                case IBV_WR_SEND_WITH_IMM:
+                    ((verify_hdr *)buf)->seq = verify_recv_seq_;
+                case IBV_WR_RDMA_WRITE_WITH_IMM:
+                    verify_recv_seq_++;
+                default:
+                    break;
+            }
+        } else {
+            // Walk over the endpoint's own MRs request by request.
+            auto buffer = mem_pool[mr_begin_ + mr_cursor_]->buffers_.front();
+            auto offset = LocalOffset();
+            mr_cursor_ = (mr_cursor_ + 1 == mr_num_) ? 0 : mr_cursor_ + 1;
+            sge[i].addr = buffer->addr_ + offset;
+            sge[i].lkey = buffer->local_key_;
+        }
+        sge[i].length = qp_case.data_size;
+        bytes_sent_now_ += sge[i].length;
+        msgs_sent_now_++;
         switch (wr_list[i].opcode) {
             case IBV_WR_RDMA_WRITE_WITH_IMM:
-                wr_list[i].imm_data = 0xdeadbeaf;
+                wr_list[i].imm_data = htonl(MakeImm(imm_seq_++, now));
             case IBV_WR_RDMA_WRITE:
             case IBV_WR_RDMA_READ:
-                wr_list[i].wr.rdma.remote_addr = remote_buffer[rbuf_idx]->addr_;
+                wr_list[i].wr.rdma.remote_addr = remote_buffer[rbuf_idx]->addr_ + RemoteOffset();
                 wr_list[i].wr.rdma.rkey = remote_buffer[rbuf_idx]->remote_key_;
                 break;
             case IBV_WR_SEND_WITH_IMM:
-                wr_list[i].imm_data = 0xfeedbeee;
+                wr_list[i].imm_data = htonl(MakeImm(imm_seq_++, now));
             case IBV_WR_SEND:
                 if (qp_type_ == IBV_QPT_UD) {
                 wr_list[i].wr.ud.remote_qkey = 0;
@@ -68,94 +106,348 @@ int htn_endpoint::PostSend(std::vector<htn_region *> &mem_pool, test_qp qp_case,
                         << wr_list[i].opcode;
                 return -1;
         }
+        if (qp_type_ == IBV_QPT_XRC_SEND) {
+            wr_list[i].qp_type.xrc.remote_srqn = remote_srqn_;
+        }
         wr_list[i].send_flags = (i == batch_size - 1) ? IBV_SEND_SIGNALED : 0;
         wr_list[i].wr_id = (uint64_t)this;
-        wr_list[i].sg_list = &sge;
+        wr_list[i].sg_list = &sge[i];
         wr_list[i].next = (i == batch_size - 1) ? nullptr : &wr_list[i + 1];
     }
+    return PostList(wr_list, batch_size, qp_case.read_num);
+}
+
+// Post kernel of a case with a single opcode
+template <enum ibv_wr_opcode kOpcode, bool kUd, bool kInline>
+int htn_endpoint::PostCase(std::vector<htn_region *> &mem_pool,
+                           const std::vector<htn_buffer *> &remote_buffer) {
+    return PostUniform<kOpcode, kUd, kInline>(mem_pool, remote_buffer, post_batch_);
+}
+
+// The READs of a case, posted apart from its other requests (--split_reads)
+int htn_endpoint::PostReads(std::vector<htn_region *> &mem_pool,
+                            const std::vector<htn_buffer *> &remote_buffer) {
+    return PostUniform<IBV_WR_RDMA_READ, false, false>(mem_pool, remote_buffer, read_batch_);
+}
+
+// A batch of one opcode, instantiated per shape so that the per-WR loop has
+// no branches left.
+template <enum ibv_wr_opcode kOpcode, bool kUd, bool kInline>
+int htn_endpoint::PostUniform(std::vector<htn_region *> &mem_pool,
+                              const std::vector<htn_buffer *> &remote_buffer,
+                              uint32_t batch_size) {
+    struct ibv_send_wr wr_list[kMaxBatch];
+    struct ibv_sge sge[kMaxBatch];
+    uint32_t length = case_.data_size;
+    for (uint32_t i = 0; i < batch_size; i++) {
+        auto buffer = mem_pool[mr_begin_ + mr_cursor_]->buffers_.front();
+        auto offset = LocalOffset();
+        mr_cursor_ = (mr_cursor_ + 1 == mr_num_) ? 0 : mr_cursor_ + 1;
+        sge[i].addr = buffer->addr_ + offset;
+        sge[i].length = length;
+        sge[i].lkey = buffer->local_key_;
+        wr_list[i].wr_id = (uint64_t)this;
+        wr_list[i].next = &wr_list[i + 1];
+        wr_list[i].sg_list = &sge[i];
+        wr_list[i].num_sge = 1;
+        wr_list[i].opcode = kOpcode;
+        wr_list[i].send_flags = kInline ? IBV_SEND_INLINE : 0;
+        if (kOpcode != IBV_WR_SEND) {
+            wr_list[i].wr.rdma.remote_addr = remote_buffer[0]->addr_ + RemoteOffset();
+            wr_list[i].wr.rdma.rkey = remote_buffer[0]->remote_key_;
+        } else if (kUd) {
+            wr_list[i].wr.ud.remote_qkey = 0;
+            wr_list[i].wr.ud.remote_qpn = remote_qpn_;
+            wr_list[i].wr.ud.ah = (ibv_ah *)context_;
+        }
+    }
+    wr_list[batch_size - 1].send_flags |= IBV_SEND_SIGNALED;
+    wr_list[batch_size - 1].next = nullptr;
+    bytes_sent_now_ += (uint64_t)length * batch_size;
+    msgs_sent_now_ += batch_size;
+    return PostList(wr_list, batch_size, kOpcode == IBV_WR_RDMA_READ ? batch_size : 0);
+}
+
+// Ring the doorbell for a batch whose last request is signaled.
+int htn_endpoint::PostList(struct ibv_send_wr *wr_list, uint32_t batch_size,
+                           uint32_t reads) {
     struct ibv_send_wr *bad_wr = nullptr;
     if (ibv_post_send(qp_, wr_list, &bad_wr)) {
         PLOG(ERROR) << "ibv_post_send() failed";
         return -1;
     }
+    OnPosted(batch_size, reads);
+    return 0;
+}
+
+void htn_endpoint::OnPosted(uint32_t batch_size, uint32_t reads) {
     send_credits_ -= batch_size;
-    send_batch_size_.push(batch_size);
+    reads_outstanding_ += reads;
+    reads_outstanding_max_ = std::max(reads_outstanding_max_, reads_outstanding_);
+    send_batches_.Push(batch_size, reads, Now64Ns());
+}
+
+// Post kernel of a DC flow: the batch goes out on a DCI of the device's pool.
+// Without a DCI with room the flow waits on the pool and -1 is returned.
+int htn_endpoint::PostDc(std::vector<htn_region *> &mem_pool,
+                         const std::vector<htn_buffer *> &remote_buffer) {
+    int d = dci_pool_->Pick(id_, context_, remote_qpn_, post_batch_);
+    if (d < 0) {
+        if (!dc_waiting_) {
+            dc_waiting_ = true;
+            dci_pool_->waiting_.push_back(id_);
+        }
+        return -1;
+    }
+    auto &dci = dci_pool_->dcis_[d];
+    uint32_t length = case_.data_size;
+    ibv_wr_start(dci.qpx);
+    for (uint32_t i = 0; i < post_batch_; i++) {
+        auto buffer = mem_pool[mr_begin_ + mr_cursor_]->buffers_.front();
+        auto offset = LocalOffset();
+        mr_cursor_ = (mr_cursor_ + 1 == mr_num_) ? 0 : mr_cursor_ + 1;
+        dci.qpx->wr_id = (uint64_t)this;
+        dci.qpx->wr_flags = (i == post_batch_ - 1) ? IBV_SEND_SIGNALED : 0;
+        // WRITEs first, like the batches of the other transports
+        auto remote_addr = remote_buffer[0]->addr_ + RemoteOffset();
+        if (i < (uint32_t)case_.write_num) {
+            ibv_wr_rdma_write(dci.qpx, remote_buffer[0]->remote_key_, remote_addr);
+        } else {
+            ibv_wr_rdma_read(dci.qpx, remote_buffer[0]->remote_key_, remote_addr);
+        }
+        mlx5dv_wr_set_dc_addr(dci.mqpx, (struct ibv_ah *)context_, remote_qpn_, kDcAccessKey);
+        ibv_wr_set_sge(dci.qpx, buffer->local_key_, buffer->addr_ + offset, length);
+    }
+    if (ibv_wr_complete(dci.qpx)) {
+        PLOG(ERROR) << "Posting to DCI " << dci.qp->qp_num << " failed";
+        return -1;
+    }
+    dci.credits -= post_batch_;
+    bytes_sent_now_ += (uint64_t)length * post_batch_;
+    msgs_sent_now_ += post_batch_;
+    OnPosted(post_batch_, case_.read_num);
     return 0;
 }
 
-// int htn_endpoint::PostRecv(const std::vector<rdma_request> &requests,
-                            // size_t &req_idx, uint32_t batch_size) {
-    // rdma_context *ctx = (rdma_context *)master_;
-    // if (recv_credits_ < batch_size) {
-    //     LOG(ERROR) << "PostRecv() failed. Credit not available: " << recv_credits_
-    //             << " is less than " << batch_size;
-    //     return -1;
-    // }
-    // struct ibv_sge sg[kMaxBatch][kMaxSge];
-    // struct ibv_recv_wr wr[kMaxBatch];
-    // struct ibv_recv_wr *bad_wr;
-    // for (uint32_t i = 0; i < batch_size; i++) {
-    //     auto &req = requests[req_idx];
-    //     for (int j = 0; j < req.sge_num; j++) {
-    //         sg[i][j].addr = req.sglist[j].addr;
-    //         sg[i][j].lkey = req.sglist[j].lkey;
-    //         sg[i][j].length = req.sglist[j].length + kUdAddition;
-    //     }
-    //     memset(&wr[i], 0, sizeof(struct ibv_recv_wr));
-    //     wr[i].num_sge = req.sge_num;
-    //     wr[i].sg_list = sg[i];
-    //     wr[i].next = (i == batch_size - 1) ? nullptr : &wr[i + 1];
-    //     wr[i].wr_id = reinterpret_cast<uint64_t>(this);
-    //     req_idx = (req_idx == requests.size() - 1) ? 0 : req_idx + 1;
-    // }
-    // if (auto ret = ibv_post_recv(qp_, wr, &bad_wr)) {
-    //     PLOG(ERROR) << "ibv_post_recv() failed";
-    //     LOG(ERROR) << "Return value is " << ret;
-    //     return -1;
-    // }
-    // recv_credits_ -= batch_size;
-    // // No need for recv. Each successful request generates a CQE
-    // // recv_batch_size_.push(batch_size);
-    // return 0;
-// }
-
-// int htn_endpoint::RestoreFromERR() {
-    // struct ibv_qp_attr attr;
-    // int attr_mask;
-    // attr_mask = IBV_QP_STATE;
-    // memset(&attr, 0, sizeof(struct ibv_qp_attr));
-    // attr.qp_state = IBV_QPS_RESET;
-    // if (ibv_modify_qp(qp_, &attr, attr_mask)) {
-    //     PLOG(ERROR) << "Failed to restore QP from ERR to RESET";
-    //     return -1;
-    // }
-    // auto remote_gid = remote_gid_;
-    // if (Activate(remote_gid)) {
-    //     PLOG(ERROR) << "Failed to restore QP to RTS";
-    //     return -1;
-    // }
-    // return 0;
-// }
+// DC counterpart of Activate(): the server brings its DCT to RTR, a client
+// flow only needs an address handle for the peer's DCT.
+int htn_endpoint::ActivateDc(const union ibv_gid &remote_gid) {
+    remote_gid_ = remote_gid;
+    if (qp_) {
+        return ConnectDct(qp_, port_num_, tc_, sl_);
+    }
+    struct ibv_ah_attr ah_attr;
+    memset(&ah_attr, 0, sizeof(ah_attr));
+    ah_attr.is_global = 1;
+    memcpy(&ah_attr.grh.dgid, &remote_gid, sizeof(union ibv_gid));
+    ah_attr.grh.sgid_index = FLAGS_gid;
+    ah_attr.grh.hop_limit = FLAGS_hop_limit;
+    ah_attr.grh.traffic_class = tc_;
+    ah_attr.sl = sl_;
+    ah_attr.port_num = port_num_;
+    if (context_) {
+        ibv_destroy_ah((struct ibv_ah *)context_);
+    }
+    context_ = ibv_create_ah(pd_, &ah_attr);
+    if (!context_) {
+        PLOG(ERROR) << "ibv_create_ah() failed for DC flow " << id_;
+        return -1;
+    }
+    InitAddrRing();
+    SelectPostKernel();
+    return 0;
+}
+
+// Remote offsets of the case's address pattern over the span the peer
+// exposed. Only clients post; --verify keeps its fixed slots.
+void htn_endpoint::InitAddrRing() {
+    int pattern = case_.addr >= 0 ? case_.addr : ParseAddrPattern(FLAGS_addr_pattern);
+    if (pattern <= kAddrFixed || FLAGS_server || verify_send_ ||
+        remote_span_ < (uint64_t)case_.data_size) {
+        delete addr_ring_;
+        addr_ring_ = nullptr;
+        return;
+    }
+    if (!addr_ring_) {
+        addr_ring_ = new htn_addr_ring();
+    }
+    uint32_t stride = case_.stride ? case_.stride
+                    : FLAGS_addr_stride ? FLAGS_addr_stride : case_.data_size;
+    addr_ring_->Init(pattern, remote_span_, case_.data_size, stride, FLAGS_addr_ring, id_);
+}
+
+// Pick the post kernel for the case once the QP is ready. Mixed opcodes,
+// immediate data and --verify stay on the generic kernel; READs are never
+// inline. With --split_reads the READs of an RC case leave the batch and
+// are posted on their own whenever fewer than max_rd_atomic are in flight.
+void htn_endpoint::SelectPostKernel() {
+    post_kernel_ = &htn_endpoint::PostGeneric;
+    post_kernel_name_ = "generic";
+    post_case_ = case_;
+    read_batch_ = 0;
+    if (dci_pool_) {
+        post_kernel_ = &htn_endpoint::PostDc;
+        post_kernel_name_ = "dc";
+        post_batch_ = case_.write_num + case_.read_num;
+        return;
+    }
+    if (FLAGS_split_reads && !verify_send_ && qp_type_ == IBV_QPT_RC &&
+        case_.read_num > 0 && case_.read_num <= kMaxBatch) {
+        read_batch_ = case_.read_num;
+        post_case_.read_num = 0;
+    }
+    auto &c = post_case_;
+    post_batch_ = c.write_num + c.read_num + c.send_recv_num + c.write_imm_num + c.send_imm_num;
+    // XRC requests carry the target SRQ, only the generic kernel sets it.
+    if (verify_send_ || c.write_imm_num || c.send_imm_num || qp_type_ == IBV_QPT_XRC_SEND ||
+        post_batch_ == 0 || post_batch_ > kMaxBatch) {
+        return;
+    }
+    bool ud = qp_type_ == IBV_QPT_UD;
+    bool inline_data = c.data_size <= FLAGS_max_inline;
+    if (c.write_num == post_batch_ && !ud) {
+        post_kernel_ = inline_data ? &htn_endpoint::PostCase<IBV_WR_RDMA_WRITE, false, true>
+                                   : &htn_endpoint::PostCase<IBV_WR_RDMA_WRITE, false, false>;
+        post_kernel_name_ = inline_data ? "write_inline" : "write";
+    } else if (c.read_num == post_batch_ && !ud) {
+        post_kernel_ = &htn_endpoint::PostCase<IBV_WR_RDMA_READ, false, false>;
+        post_kernel_name_ = "read";
+    } else if (c.send_recv_num == post_batch_ && ud) {
+        post_kernel_ = inline_data ? &htn_endpoint::PostCase<IBV_WR_SEND, true, true>
+                                   : &htn_endpoint::PostCase<IBV_WR_SEND, true, false>;
+        post_kernel_name_ = inline_data ? "ud_send_inline" : "ud_send";
+    } else if (c.send_recv_num == post_batch_) {
+        post_kernel_ = inline_data ? &htn_endpoint::PostCase<IBV_WR_SEND, false, true>
+                                   : &htn_endpoint::PostCase<IBV_WR_SEND, false, false>;
+        post_kernel_name_ = inline_data ? "send_inline" : "send";
+    }
+}
 
-int htn_endpoint::Activate(const union ibv_gid &remote_gid) {
+// Post receive requests for SEND and WRITE_WITH_IMM traffic. Every request
+// lands in recv_buf_; the payload is not consumed, only accounted.
+int htn_endpoint::PostRecv(uint32_t batch_size) {
+    if (recv_credits_ < batch_size) {
+        LOG(ERROR) << "PostRecv() failed. Credit not available: " << recv_credits_
+                << " is less than " << batch_size;
+        return -1;
+    }
+    struct ibv_sge sge[kMaxBatch];
+    struct ibv_recv_wr wr[kMaxBatch];
+    struct ibv_recv_wr *bad_wr;
+    for (uint32_t i = 0; i < batch_size; i++) {
+        if (verify_recv_) {
+            // Receive requests complete in order, so slot n holds the n-th message.
+            uint32_t slot = verify_recv_posted_++ % verify_recv_->num_;
+            sge[i].addr = (uint64_t)verify_recv_->addr_ + (uint64_t)slot * verify_recv_->size_;
+            sge[i].lkey = verify_recv_->mr_->lkey;
+            sge[i].length = verify_recv_->size_;
+        } else {
+            sge[i].addr = recv_buf_->addr_;
+            sge[i].lkey = recv_buf_->local_key_;
+            sge[i].length = recv_buf_->size_;
+        }
+        memset(&wr[i], 0, sizeof(struct ibv_recv_wr));
+        wr[i].num_sge = 1;
+        wr[i].sg_list = &sge[i];
+        wr[i].next = (i == batch_size - 1) ? nullptr : &wr[i + 1];
+        wr[i].wr_id = reinterpret_cast<uint64_t>(this);
+    }
+    if (auto ret = ibv_post_recv(qp_, wr, &bad_wr)) {
+        PLOG(ERROR) << "ibv_post_recv() failed";
+        LOG(ERROR) << "Return value is " << ret;
+        return -1;
+    }
+    recv_credits_ -= batch_size;
+    // No need for recv. Each successful request generates a CQE
+    return 0;
+}
+
+// Bring a QP in any state back to RTS through RESET. The peer QP has to be
+// reset as well and both sides must agree on the new PSNs.
+int htn_endpoint::RestoreFromERR(uint32_t sq_psn, uint32_t rq_psn) {
+    struct ibv_qp_attr attr;
+    int attr_mask;
+    attr_mask = IBV_QP_STATE;
+    memset(&attr, 0, sizeof(struct ibv_qp_attr));
+    attr.qp_state = IBV_QPS_RESET;
+    if (ibv_modify_qp(qp_, &attr, attr_mask)) {
+        PLOG(ERROR) << "Failed to restore QP from ERR to RESET";
+        return -1;
+    }
+    auto remote_gid = remote_gid_;
+    if (Activate(remote_gid, sq_psn, rq_psn)) {
+        PLOG(ERROR) << "Failed to restore QP to RTS";
+        return -1;
+    }
+    return 0;
+}
+
+// Forget the requests a reset QP dropped. Verification sequences restart on
+// both sides, so the n-th receive maps to slot n again.
+void htn_endpoint::ResetQueues() {
+    send_credits_ = FLAGS_send_wq_depth;
+    recv_credits_ = srq_ ? 0 : FLAGS_recv_wq_depth;
+    send_batches_.Clear();
+    reads_outstanding_ = 0;
+    verify_send_idx_ = 0;
+    verify_send_done_ = 0;
+    verify_recv_posted_ = 0;
+    verify_recv_seq_ = 0;
+    verify_recv_done_ = 0;
+}
+
+// Account a bad completion. Flush errors follow the first failure of a QP and
+// are only counted, the first real error fails the endpoint.
+void htn_endpoint::OnError(struct ibv_wc *wc) {
+    wc_errors_[wc->status < kWcStatusNum ? wc->status : kWcStatusNum - 1]++;
+    if (wc->status == IBV_WC_WR_FLUSH_ERR) {
+        return;
+    }
+    // Only the first few are logged, an error storm is visible in the counters.
+    if (errors_++ < kErrorLogLimit) {
+        LOG(ERROR) << "conn " << id_ << " qpn " << qp_->qp_num << " bad completion: "
+                << ibv_wc_status_str(wc->status) << " (" << wc->status
+                << "), vendor error " << wc->vendor_err;
+    }
+    int expected = kEpActive;
+    state_.compare_exchange_strong(expected, kEpFailed);
+}
+
+int htn_endpoint::Activate(const union ibv_gid &remote_gid, uint32_t sq_psn,
+                           uint32_t rq_psn) {
+    if (qp_type_ == (enum ibv_qp_type)kQptDc) {
+        return ActivateDc(remote_gid);
+    }
     remote_gid_ = remote_gid;
     struct ibv_qp_attr attr;
     int attr_mask;
-    attr = MakeQpAttr(IBV_QPS_INIT, qp_type_, 0, remote_gid, &attr_mask);
+    attr = MakeQpAttr(IBV_QPS_INIT, qp_type_, port_num_, 0, remote_gid, &attr_mask);
     if (ibv_modify_qp(qp_, &attr, attr_mask)) {
         PLOG(ERROR) << "Failed to modify QP to INIT";
         return -1;
     }
-    attr = MakeQpAttr(IBV_QPS_RTR, qp_type_, remote_qpn_, remote_gid, &attr_mask);
+    attr = MakeQpAttr(IBV_QPS_RTR, qp_type_, port_num_, remote_qpn_, remote_gid, &attr_mask);
+    attr.rq_psn = rq_psn;
+    attr.ah_attr.grh.traffic_class = tc_;
+    attr.ah_attr.sl = sl_;
+    if (qp_type_ == IBV_QPT_RC || qp_type_ == IBV_QPT_XRC_RECV) {
+        attr.max_dest_rd_atomic = dest_rd_atomic_;
+    }
     if (ibv_modify_qp(qp_, &attr, attr_mask)) {
         PLOG(ERROR) << "Failed to modify QP to RTR";
         return -1;
     }
-    attr = MakeQpAttr(IBV_QPS_RTS, qp_type_, remote_qpn_, remote_gid, &attr_mask);
+    attr = MakeQpAttr(IBV_QPS_RTS, qp_type_, port_num_, remote_qpn_, remote_gid, &attr_mask);
+    attr.sq_psn = sq_psn;
+    if (qp_type_ == IBV_QPT_RC || qp_type_ == IBV_QPT_XRC_SEND) {
+        attr.max_rd_atomic = rd_atomic_;
+    }
     if (ibv_modify_qp(qp_, &attr, attr_mask)) {
         PLOG(ERROR) << "Failed to modify QP to RTS";
         return -1;
     }
+    InitAddrRing();
+    SelectPostKernel();
     // if (qp_type_ == IBV_QPT_UD) {
     //     struct ibv_ah_attr ah_attr;
     //     memset(&ah_attr, 0, sizeof(ah_attr));
@@ -181,47 +473,182 @@ int htn_endpoint::Activate(const union ibv_gid &remote_gid) {
 }
 
 int htn_endpoint::SendHandler(struct ibv_wc *wc) {
-    auto update_credits = send_batch_size_.front();
-    send_batch_size_.pop();
+    auto &batch = send_batches_.Front();
+    auto update_credits = batch.size;
+    reads_outstanding_ -= batch.reads;
+    reads_done_ += batch.reads;
+    if (batch_lat_) {
+        auto lat = Now64Ns() - batch.ts;
+        batch_lat_->Add(lat);
+        class_lat_->Add(lat);
+    }
+    send_batches_.Pop();
     send_credits_ += update_credits;
-    // todo: trigger post send
+    if (verify_send_) {
+        // Only the last request of a batch is signaled, so the whole batch is
+        // done. READs sit right after the WRITEs in every batch. Their
+        // responses overwrote the slots, which are stamped again before a
+        // later batch sends from them.
+        for (int k = case_.write_num; k < case_.write_num + case_.read_num; k++) {
+            uint32_t slot = (verify_send_done_ + k) % verify_send_->num_;
+            if (verify_read_) {
+                VerifySlot(verify_send_, slot, case_.data_size, -1);
+            }
+            VerifyStamp((char *)verify_send_->addr_ + (uint64_t)slot * verify_send_->size_,
+                        case_.data_size, id_, slot);
+        }
+        verify_send_done_ += update_credits;
+    }
+    // The client loop reposts the endpoint right after this poll, see
+    // htn_context::PostBatch().
     return 0;
 }
 
-// int htn_endpoint::RecvHandler(struct ibv_wc *wc) {
-    // // Reply or something else here.
-    // // auto update_credits = recv_batch_size_.front();
-    // // recv_batch_size_.pop();
-    // // recv_credits_ += update_credits;
-    // recv_credits_++;
-    // return 0;
-// }
-
-// void htn_endpoint::PrintThroughput(uint64_t timestamp) {
-    // if (bytes_sent_last_ == 0) {
-    //     timestamp_ = timestamp;
-    //     bytes_sent_last_ = bytes_sent_now_;
-    //     msgs_sent_last_ = msgs_sent_now_;
-    //     return;
-    // }
-    // auto t = timestamp - timestamp_;
-    // if (t >= 1000000) {  // report every 1s.
-    //     auto throughput =
-    //         (bytes_sent_now_ - bytes_sent_last_) * 8.0 * 1.0 / t;          // mbps
-    //     auto qps = (msgs_sent_now_ - msgs_sent_last_) * 1.0 * 1000.0 / t;  // krps
-    //     LOG(INFO) << "conn " << id_ << " " << ((rdma_context *)master_)->GetIp()
-    //             << ":" << qp_->qp_num << "-" << remote_server_ << ":"
-    //             << remote_qpn_ << " Bytes=" << bytes_sent_now_
-    //             << " Rate=" << (int)throughput << " Mbps  ("
-    //             << throughput / 1000.0 << " Gbps)";
-    //     timestamp_ = timestamp;
-    //     LOG(INFO) << "\t\t\t\t"
-    //             << " Message rate is " << qps << " Krps (" << qps / 1000.0
-    //             << " Mrps)";
-    //     bytes_sent_last_ = bytes_sent_now_;
-    //     msgs_sent_last_ = msgs_sent_now_;
-    // }
-    // return;
-// }
+int htn_endpoint::RecvHandler(struct ibv_wc *wc) {
+    if (verify_recv_ && wc->opcode == IBV_WC_RECV) {
+        VerifySlot(verify_recv_, verify_recv_done_ % verify_recv_->num_, wc->byte_len,
+                   (uint32_t)verify_recv_done_);
+    }
+    verify_recv_done_++;
+    if (srq_) {
+        srq_->credits_++;
+    } else {
+        recv_credits_++;
+    }
+    msgs_recv_now_++;
+    bytes_recv_now_ += wc->byte_len;
+    if (!(wc->wc_flags & IBV_WC_WITH_IMM)) {
+        return 0;
+    }
+    auto imm = ntohl(wc->imm_data);
+    auto seq = ImmSeq(imm);
+    // Signed distance in the 16-bit sequence space: > 0 means requests were
+    // skipped (reordered ahead or lost), < 0 means a late arrival.
+    auto dist = (int16_t)(seq - imm_expect_seq_);
+    if (imm_recv_ && dist != 0) {
+        imm_ooo_++;
+    }
+    if (!imm_recv_ || dist >= 0) {
+        imm_expect_seq_ = (seq + 1) & kImmSeqMask;
+    }
+    imm_recv_++;
+    auto lat = ImmLatency(imm, Now64());
+    imm_lat_sum_ += lat;
+    imm_lat_min_ = std::min(imm_lat_min_, lat);
+    imm_lat_max_ = std::max(imm_lat_max_, lat);
+    return 0;
+}
+
+void htn_endpoint::PrintThroughput(uint64_t timestamp) {
+    if (bytes_sent_last_ == 0) {
+        timestamp_ = timestamp;
+        bytes_sent_last_ = bytes_sent_now_;
+        msgs_sent_last_ = msgs_sent_now_;
+        return;
+    }
+    auto t = timestamp - timestamp_;
+    if (t >= 1000000) {  // report every 1s.
+        auto throughput =
+            (bytes_sent_now_ - bytes_sent_last_) * 8.0 * 1.0 / t;          // mbps
+        auto qps = (msgs_sent_now_ - msgs_sent_last_) * 1.0 * 1000.0 / t;  // krps
+        LOG(INFO) << "conn " << id_ << " " << (qp_ ? qp_->qp_num : 0) << "-" << remote_server_
+                << ":" << remote_qpn_ << " Bytes=" << bytes_sent_now_
+                << " Rate=" << (int)throughput << " Mbps  ("
+                << throughput / 1000.0 << " Gbps)";
+        timestamp_ = timestamp;
+        LOG(INFO) << "\t\t\t\t"
+                << " Message rate is " << qps << " Krps (" << qps / 1000.0
+                << " Mrps)";
+        if (verify_send_) {
+            LOG(INFO) << "\t\t\t\t"
+                    << " Verified " << verify_ok_ << " corrupted " << verify_err_;
+        }
+        if (reads_done_ != reads_done_last_) {
+            // Responses of the interval against the initiator's read limit
+            auto reads = reads_done_ - reads_done_last_;
+            LOG(INFO) << "\t\t\t\t"
+                    << " Read responses " << reads * 1.0 / t << " Mrps ("
+                    << reads * case_.data_size * 8.0 / t / 1000.0 << " Gbps), outstanding max "
+                    << reads_outstanding_max_ << " of max_rd_atomic " << rd_atomic_
+                    << (read_batch_ ? ", split" : "");
+            reads_done_last_ = reads_done_;
+            reads_outstanding_max_ = reads_outstanding_;
+        }
+        if (errors_ != errors_last_ || state_ != kEpActive) {
+            LOG(INFO) << "\t\t\t\t"
+                    << " Errors +" << errors_ - errors_last_ << " (total " << errors_
+                    << ", recoveries " << recoveries_ << ")"
+                    << (state_ == kEpActive ? "" : ", recovering");
+            errors_last_ = errors_;
+        }
+        bytes_sent_last_ = bytes_sent_now_;
+        msgs_sent_last_ = msgs_sent_now_;
+    }
+    return;
+}
+
+// Receiver side counterpart of PrintThroughput: message rate of consumed
+// receive requests plus sequence and one-way latency of immediate data.
+void htn_endpoint::PrintRecvStats(uint64_t timestamp) {
+    if (timestamp_ == 0) {
+        timestamp_ = timestamp;
+        return;
+    }
+    auto t = timestamp - timestamp_;
+    if (t < 1000000) {  // report every 1s.
+        return;
+    }
+    auto qps = (msgs_recv_now_ - msgs_recv_last_) * 1.0 * 1000.0 / t;  // krps
+    auto imm_num = imm_recv_ - imm_recv_last_;
+    LOG(INFO) << "conn " << id_ << " " << qp_->qp_num << "-" << remote_server_
+            << ":" << remote_qpn_ << " Recv rate is " << qps << " Krps"
+            << " Imm=" << imm_recv_ << " OutOfOrder=" << imm_ooo_;
+    if (imm_num) {
+        LOG(INFO) << "\t\t\t\t"
+                << " One-way latency avg "
+                << (imm_lat_sum_ - imm_lat_sum_last_) / imm_num << " us, min "
+                << imm_lat_min_ << " us, max " << imm_lat_max_ << " us";
+    }
+    if (verify_recv_) {
+        LOG(INFO) << "\t\t\t\t"
+                << " Verified " << verify_ok_ << " corrupted " << verify_err_;
+    }
+    if (errors_ != errors_last_ || state_ != kEpActive) {
+        LOG(INFO) << "\t\t\t\t"
+                << " Errors +" << errors_ - errors_last_ << " (total " << errors_
+                << ", recoveries " << recoveries_ << ")"
+                << (state_ == kEpActive ? "" : ", recovering");
+        errors_last_ = errors_;
+    }
+    timestamp_ = timestamp;
+    msgs_recv_last_ = msgs_recv_now_;
+    imm_recv_last_ = imm_recv_;
+    imm_lat_sum_last_ = imm_lat_sum_;
+    imm_lat_min_ = UINT32_MAX;
+    imm_lat_max_ = 0;
+}
+
+// Check one slot of a verify ring. expect_seq < 0 skips the sequence check.
+void htn_endpoint::VerifySlot(htn_region *region, uint32_t slot, uint32_t len,
+                              int64_t expect_seq) {
+    auto buf = (char *)region->addr_ + (uint64_t)slot * region->size_;
+    auto hdr = (verify_hdr *)buf;
+    auto off = VerifyCheck(buf, len);
+    if (off < 0 && expect_seq >= 0 && hdr->seq != (uint32_t)expect_seq) {
+        off = offsetof(verify_hdr, seq);
+    }
+    if (off < 0) {
+        verify_ok_++;
+        return;
+    }
+    // Only the first few are logged, a corruption storm is visible in the counters.
+    if (verify_err_++ < kVerifyLogLimit) {
+        LOG(ERROR) << "Data mismatch on conn " << id_ << " qpn " << qp_->qp_num
+                << " mr lkey " << region->mr_->lkey << " offset "
+                << (uint64_t)slot * region->size_ + off << " (slot " << slot
+                << " byte " << off << ", stamped by qp " << hdr->qp
+                << " seq " << hdr->seq << ")";
+    }
+}
 
 }  // namespace Collie
\ No newline at end of file
@@ -7,10 +7,16 @@
 
 #ifndef HTN_ENDPOINT_HH
 #define HTN_ENDPOINT_HH
-#include <queue>
+#include <atomic>
+#include <vector>
 
 #include "htn_helper.hh"
 #include "htn_memory.hh"
+#include "htn_verify.hh"
+#include "htn_stats.hh"
+#include "htn_dc.hh"
+#include "htn_srq.hh"
+#include "htn_pattern.hh"
 
 namespace Htn {
 
@@ -21,36 +27,167 @@ public:
     std::vector<struct ibv_sge> sglist;
 };
 
-class htn_endpoint {
+// Error handling state. The datapath thread owning an endpoint moves it from
+// active to failed on a bad completion, drains its CQ once more and parks it.
+// A parked endpoint belongs to the recovery code until it is active again.
+enum htn_ep_state {
+    kEpActive = 0,
+    kEpFailed,
+    kEpParked,
+};
+
+// Signaled batches in flight, oldest first. A batch holds at least one send
+// credit, so a ring of the send queue depth never overflows.
+struct htn_batch {
+    uint32_t size;
+    uint32_t reads;  // RDMA READs among the requests
+    uint64_t ts;     // posted, ns
+};
+
+class htn_batch_ring {
+public:
+    void Init(uint32_t capacity) {
+        uint32_t n = 1;
+        while (n < capacity) {
+            n <<= 1;
+        }
+        slots_.resize(n);
+        mask_ = n - 1;
+        Clear();
+    }
+    bool Empty() const { return head_ == tail_; }
+    const htn_batch &Front() const { return slots_[tail_ & mask_]; }
+    void Push(uint32_t size, uint32_t reads, uint64_t ts) {
+        auto &batch = slots_[head_++ & mask_];
+        batch.size = size;
+        batch.reads = reads;
+        batch.ts = ts;
+    }
+    void Pop() { tail_++; }
+    void Clear() { head_ = tail_ = 0; }
+
+private:
+    std::vector<htn_batch> slots_;
+    uint32_t mask_ = 0;
+    uint32_t head_ = 0;
+    uint32_t tail_ = 0;
+};
+
+// Endpoints live in one cache-line aligned array of the context. Fields the
+// datapath touches for every batch come first, setup, reporting,
+// verification and recovery state follow.
+class alignas(64) htn_endpoint {
 public:
     struct ibv_qp *qp_ = nullptr;
     uint32_t id_ = 0;
-    enum ibv_qp_type qp_type_;
-    union ibv_gid remote_gid_;
+    int slot_ = 0;  // index in the device's endpoint_ids_
+    std::atomic<int> state_{kEpActive};  // see htn_ep_state
     uint32_t send_credits_ = 0;
     uint32_t recv_credits_ = 0;
+    bool activated_ = false;
+    bool queued_ = false;  // waiting in the device's ready_ list
+    bool dc_waiting_ = false;  // waiting for a DCI, see htn_dci_pool
+    htn_dci_pool *dci_pool_ = nullptr;  // DC flows only
+    htn_srq *srq_ = nullptr;  // server receives of --recv_topology=srq/xrc
+    uint32_t remote_srqn_ = 0;  // XRC send QPs only
+    htn_addr_ring *addr_ring_ = nullptr;  // remote offsets, null for --addr_pattern=fixed
+    // Local offsets of the alignment class: drawn for rand, else one per
+    // region of the endpoint, empty for base
+    htn_addr_ring *local_ring_ = nullptr;
+    std::vector<uint32_t> local_offsets_;
+    // Post kernel specialized for the case, see SelectPostKernel()
+    int (htn_endpoint::*post_kernel_)(std::vector<htn_region *> &,
+                                      const std::vector<htn_buffer *> &) = &htn_endpoint::PostGeneric;
+    uint32_t post_batch_ = 0;
+    // READs in flight and the initiator limit on them (max_rd_atomic). With
+    // --split_reads they are posted in batches of read_batch_ of their own.
+    uint32_t reads_outstanding_ = 0;
+    uint32_t rd_atomic_ = 0;
+    uint32_t read_batch_ = 0;
+    // Local regions owned by this endpoint: mem_pool[mr_begin_, mr_begin_ + mr_num_)
+    int mr_begin_ = 0;
+    int mr_num_ = 1;
+    int mr_cursor_ = 0;
+    htn_batch_ring send_batches_;
+    // post-to-completion latency of signaled batches, owned by the device,
+    // overall and of the endpoint's priority class
+    htn_histogram *batch_lat_ = nullptr;
+    htn_histogram *class_lat_ = nullptr;
+    uint64_t bytes_sent_now_ = 0;
+    uint64_t msgs_sent_now_ = 0;
+    uint64_t bytes_recv_now_ = 0;
+    uint64_t msgs_recv_now_ = 0;
+    uint32_t imm_seq_ = 0;
+    enum ibv_qp_type qp_type_;
+    // Buffer the peer exposed on this channel
+    std::vector<htn_buffer *> remote_bufs_;
+    // Local buffer that receive requests land in
+    htn_buffer *recv_buf_ = nullptr;
+    test_qp case_;
+    test_qp post_case_;  // the part of case_ a post kernel issues
+
+    // Cold from here on
+    const char *post_kernel_name_ = "generic";
+    int port_num_ = 1;
+    union ibv_gid remote_gid_;
     // Remote Information
     std::string remote_server_;
+    std::string remote_host_;  // TCP address of the peer, used for recovery
     uint32_t remote_qpn_ = 0;
+    uint64_t remote_span_ = 0;  // bytes the peer registered behind remote_bufs_
+    std::string align_class_ = "base";  // see htn_align_class
     // Remote info for UD
     uint16_t dlid_ = 0;
     uint8_t remote_sl_ = 0;
     // Remote memory pool id
     int rmem_id_ = -1;
+    uint32_t dest_rd_atomic_ = 0;  // responder resources (max_dest_rd_atomic)
+    uint8_t tc_ = 0;  // traffic class and service level of the path
+    uint8_t sl_ = 0;
+    struct ibv_pd *pd_ = nullptr;  // of the address handle of a DC flow
 
-    std::queue<int> send_batch_size_;
-    std::queue<int> recv_batch_size_;
-
-    bool activated_ = false;
     void *master_ = nullptr;
     void *context_ = nullptr;
 
     // For statistics
     uint64_t bytes_sent_last_ = 0;
-    uint64_t bytes_sent_now_ = 0;
     uint64_t msgs_sent_last_ = 0;
-    uint64_t msgs_sent_now_ = 0;
     uint64_t timestamp_ = 0;
+    uint64_t msgs_recv_last_ = 0;
+    uint64_t reads_done_ = 0;
+    uint64_t reads_done_last_ = 0;
+    uint32_t reads_outstanding_max_ = 0;  // in the current report interval
+
+    // Immediate data: receiver accounting
+    uint32_t imm_expect_seq_ = 0;
+    uint64_t imm_recv_ = 0;
+    uint64_t imm_ooo_ = 0;
+    uint64_t imm_lat_sum_ = 0;
+    uint32_t imm_lat_min_ = UINT32_MAX;
+    uint32_t imm_lat_max_ = 0;
+    uint64_t imm_recv_last_ = 0;
+    uint64_t imm_lat_sum_last_ = 0;
+
+    // Data verification (--verify). Each request owns a slot of a private
+    // ring so that stamped data is never rewritten while in flight.
+    htn_region *verify_send_ = nullptr;
+    htn_region *verify_recv_ = nullptr;
+    bool verify_read_ = false;
+    uint64_t verify_send_idx_ = 0;
+    uint64_t verify_send_done_ = 0;
+    uint64_t verify_recv_posted_ = 0;
+    uint32_t verify_recv_seq_ = 0;
+    uint64_t verify_recv_done_ = 0;
+    uint64_t verify_ok_ = 0;
+    uint64_t verify_err_ = 0;
+
+    // Error recovery
+    uint64_t wc_errors_[kWcStatusNum] = {};  // bad completions per wc.status
+    uint64_t errors_ = 0;  // bad completions, flushes excluded
+    uint64_t errors_last_ = 0;
+    uint64_t recoveries_ = 0;
+    int recovery_failed_ = 0;  // failed attempts in a row
+    uint64_t recover_ts_ = 0;  // earliest time of the next attempt
 
 public:
     htn_endpoint(uint32_t id, ibv_qp *qp)
@@ -62,18 +199,80 @@ public:
             {}
     ~htn_endpoint() {
         if (qp_) ibv_destroy_qp(qp_);
+        if (verify_send_) {
+            verify_send_->Free();
+            delete verify_send_;
+        }
+        if (verify_recv_) {
+            verify_recv_->Free();
+            delete verify_recv_;
+        }
+        for (auto buf : remote_bufs_) {
+            delete buf;
+        }
+        delete addr_ring_;
+        delete local_ring_;
     }
 
 public:
-    int PostSend(std::vector<htn_region *> &mem_pool, test_qp qp_case,
-                            const std::vector<htn_buffer *> &remote_buffer);
-    // int PostRecv(const std::vector<rdma_request> &requests, size_t &req_idx,
-    //             uint32_t batch_size);
-    int Activate(const union ibv_gid &remote_gid);
-    // int RestoreFromERR();
+    // Post one batch of the endpoint's case with the kernel picked at
+    // activation
+    int PostSend(std::vector<htn_region *> &mem_pool,
+                 const std::vector<htn_buffer *> &remote_buffer) {
+        return (this->*post_kernel_)(mem_pool, remote_buffer);
+    }
+    bool CanPostReads() const {
+        // A READ batch larger than the limit still goes out on an idle QP.
+        return read_batch_ && send_credits_ >= read_batch_ &&
+               (reads_outstanding_ == 0 || reads_outstanding_ + read_batch_ <= rd_atomic_);
+    }
+    // Whether the credits allow the next batch
+    bool CanPost() const {
+        return (post_batch_ && send_credits_ >= post_batch_) || CanPostReads();
+    }
+    // Post the next batch, READs first when they are split off and allowed
+    int PostNext(std::vector<htn_region *> &mem_pool,
+                 const std::vector<htn_buffer *> &remote_buffer) {
+        return CanPostReads() ? PostReads(mem_pool, remote_buffer)
+                              : PostSend(mem_pool, remote_buffer);
+    }
+    int PostGeneric(std::vector<htn_region *> &mem_pool,
+                    const std::vector<htn_buffer *> &remote_buffer);
+    template <enum ibv_wr_opcode kOpcode, bool kUd, bool kInline>
+    int PostCase(std::vector<htn_region *> &mem_pool,
+                 const std::vector<htn_buffer *> &remote_buffer);
+    int PostReads(std::vector<htn_region *> &mem_pool,
+                  const std::vector<htn_buffer *> &remote_buffer);
+    template <enum ibv_wr_opcode kOpcode, bool kUd, bool kInline>
+    int PostUniform(std::vector<htn_region *> &mem_pool,
+                    const std::vector<htn_buffer *> &remote_buffer, uint32_t batch_size);
+    int PostDc(std::vector<htn_region *> &mem_pool,
+               const std::vector<htn_buffer *> &remote_buffer);
+    int PostList(struct ibv_send_wr *wr_list, uint32_t batch_size, uint32_t reads);
+    void OnPosted(uint32_t batch_size, uint32_t reads);
+    int ActivateDc(const union ibv_gid &remote_gid);
+    void SelectPostKernel();
+    int PostRecv(uint32_t batch_size);
+    void InitAddrRing();
+    uint64_t RemoteOffset() { return addr_ring_ ? addr_ring_->Next() : 0; }
+    // Call before mr_cursor_ moves on to the next region
+    uint64_t LocalOffset() {
+        if (local_ring_) {
+            return local_ring_->Next();
+        }
+        return local_offsets_.empty() ? 0 : local_offsets_[mr_cursor_];
+    }
+    int Activate(const union ibv_gid &remote_gid, uint32_t sq_psn = 0,
+                 uint32_t rq_psn = 0);
+    int RestoreFromERR(uint32_t sq_psn, uint32_t rq_psn);
+    void ResetQueues();
+    void OnError(struct ibv_wc *wc);
     int SendHandler(struct ibv_wc *wc);
-    // int RecvHandler(struct ibv_wc *wc);
-    // void PrintThroughput(uint64_t timestamp);
+    int RecvHandler(struct ibv_wc *wc);
+    void PrintThroughput(uint64_t timestamp);
+    void PrintRecvStats(uint64_t timestamp);
+    void VerifySlot(htn_region *region, uint32_t slot, uint32_t len,
+                    int64_t expect_seq);
 
     // enum ibv_qp_type GetType() { return qp_type_; }
     // int GetQpn() { return qp_->qp_num; }
@@ -6,6 +6,7 @@
 // See LICENSE for license information#
 
 #include "htn_helper.hh"
+#include "htn_pattern.hh"
 
 
 // FLAGS
@@ -19,24 +20,91 @@ DEFINE_string(connect_ip, "", "IP address of the server");
 // DEFINE_string(traffic);
 DEFINE_int32(min_rnr_timer, 14, "Minimal Receive Not Ready error");
 DEFINE_int32(hop_limit, 16, "Hop limit");
-DEFINE_int32(tos, 0, "Type of Service value");
+DEFINE_int32(tos, 0, "Type of Service value, case option tc= overrides it per QP");
+DEFINE_int32(sl, 0, "Service level, case option sl= overrides it per QP");
 DEFINE_int32(qp_timeout, 0, "QP timeout value");
 DEFINE_int32(retry_cnt, 7, "QP retry count");
 DEFINE_int32(rnr_retry, 7, "Receive Not Ready retry count");
-DEFINE_int32(max_qp_rd_atom, 16, "max_qp_rd_atom");
+DEFINE_int32(max_qp_rd_atom, 16, "max_rd_atomic and max_dest_rd_atomic of RC QPs, case options rd_atomic= and dest_rd_atomic= override it per QP");
+DEFINE_int32(dci_num, 16, "DCIs per device that the flows of DC cases share");
+DEFINE_string(dci_policy, "hash", "Mapping of DC flows onto DCIs: hash, rr or lru");
+DEFINE_int32(dc_flow_depth, 64, "Requests one DC flow may have in flight");
+DEFINE_bool(split_reads, false, "Post the READs of an RC case in batches of their own, limited by the QP's max_rd_atomic");
 DEFINE_int32(mtu, IBV_MTU_4096,
              "IBV_MTU value: 256/512/1024/2048/4096");
 
 DEFINE_int32(send_wq_depth, 1024, "Send Work Queue depth");
 DEFINE_int32(recv_wq_depth, 1024, "Recv Work Queue depth");
+DEFINE_string(recv_topology, "qp", "Receive side of RC cases: qp (a receive queue per QP), srq (one SRQ per server PD) or xrc (XRC QPs on one XRC SRQ per server PD), set on both sides");
+DEFINE_int32(srq_depth, 4096, "Receives of each SRQ with --recv_topology=srq/xrc");
 
 // DEFINE_int32(cq_sharing_num);
-DEFINE_int32(mr_num_per_qp, 1, "");
+DEFINE_int32(mr_num_per_qp, 1, "MRs of a QP whose case line gives mr_num 0");
+DEFINE_int32(mr_reg_threads, 1, "Threads registering MRs at startup");
+DEFINE_int32(mr_churn_num, 0, "MRs deregistered/registered during traffic, 0 to disable");
+DEFINE_int32(mr_churn_rate, 0, "MR re-registrations per second, 0 for as fast as possible");
+DEFINE_int32(qp_churn_threads, 0, "Threads creating, connecting, using and destroying QP pairs during traffic, 0 to disable");
+DEFINE_int32(qp_churn_rate, 0, "QP pairs churned per second over all threads, 0 for as fast as possible");
+DEFINE_string(pd_mode, "single", "PD topology: single, qp (one per QP), group (one per case group), rr");
+DEFINE_int32(pd_num, 1, "Number of PDs QPs are spread over round-robin with --pd_mode=rr");
 
 // Resource Management
 DEFINE_int32(cq_depth, 65536, "CQ depth");
+DEFINE_string(cq_mode, "poll", "Completion handling: poll (busy), event (completion channel + epoll), hybrid");
+DEFINE_int32(hybrid_spin_us, 50, "Hybrid mode: spin this long without progress before sleeping");
+DEFINE_int32(cq_poll_budget, 0, "CQEs taken from one CQ per polling round, 0 to drain it");
+DEFINE_int32(max_inline, 0, "Inline data capacity of send queues, write/send cases up to this size post inline");
+DEFINE_int32(post_coalesce_us, 0, "Collect reposts of endpoints for this long and post them together, 0 to repost on every completion");
 DEFINE_int32(buf_size, 65536, "buffer size");
 DEFINE_int32(buf_num, 1, "The number of buffers owned by one QP");
+DEFINE_string(addr_pattern, "fixed", "Remote offsets of WRITE/READ in the peer's buf_size * buf_num span: fixed, seq, rand, zipf or page, case option addr= overrides it");
+DEFINE_int32(addr_stride, 0, "Distance of the slots of seq/rand/zipf offsets, 0 for the message size, case option stride= overrides it");
+DEFINE_int32(addr_ring, 16384, "Precomputed offsets per endpoint for rand, zipf and page");
+DEFINE_double(zipf_theta, 0.99, "Skew of --addr_pattern=zipf, in (0, 1)");
+DEFINE_string(local_align, "base", "Placement of messages in their local buffer: base, page, offset, rand, cross4k or cross2m, case option align= overrides it");
+DEFINE_int32(local_offset, 0, "Bytes past a 4 KB boundary of --local_align=offset, case option offset= overrides it");
+
+// Run control
+DEFINE_int32(warmup, 0, "Minimal warm-up time in seconds before measuring");
+DEFINE_int32(duration, 0, "Measurement time in seconds, 0 to run forever");
+DEFINE_int32(stats_interval_ms, 1000, "Sampling interval of the run controller");
+DEFINE_double(steady_cv, 0, "Also wait for the coefficient of variation of the message rate to drop below this, 0 to disable");
+DEFINE_int32(steady_window, 5, "Samples the steady state detector looks at");
+DEFINE_int32(steady_timeout, 60, "Give up waiting for steady state after warm-up plus this many seconds");
+DEFINE_string(hw_counters, "",
+              "Port counters sampled every stats interval, e.g. out_of_buffer,rnr_nak_retry_err,local_ack_timeout_err, \"all\" for every counter of the port, empty (default) to disable");
+DEFINE_bool(cc_stats, false, "Log the congestion control counters of every device each stats interval and over the measurement window");
+DEFINE_string(cc_counters, "np_cnp_sent,np_ecn_marked_roce_packets,rp_cnp_handled,rp_cnp_ignored",
+              "hw_counters of the port read by --cc_stats");
+DEFINE_string(cc_ethtool, "ecn,cnp,pause_ctrl,discards_phy",
+              "--cc_stats also reads the ethtool statistics of the port's netdev containing one of these substrings");
+DEFINE_string(cc_profile, "", "File of knob=value lines written under /sys/class/net/<netdev>/ecn before the run, restored after a timed run");
+DEFINE_int32(fair_interval_ms, 100, "Window of the per-QP fairness monitor");
+DEFINE_int32(starve_share, 0, "A QP below this percentage of its fair share is starving, 0 disables the monitor");
+DEFINE_int32(starve_ms, 500, "Report a starvation event after a QP starved this long");
+DEFINE_string(results, "", "Binary results log written every stats interval, see htn_analyzer");
+DEFINE_int64(results_records, 1 << 20, "Records of all QPs the results log holds before it wraps, rounded down to whole intervals");
+
+// On-demand paging
+DEFINE_bool(odp, false, "Register every region with IBV_ACCESS_ON_DEMAND");
+DEFINE_bool(odp_implicit, false, "Use one implicit ODP MR per PD for all regions");
+DEFINE_bool(odp_prefetch, false, "Prefetch regions with ibv_advise_mr after registration");
+
+// Data verification
+DEFINE_bool(verify, false, "Stamp send buffers and check received/read data");
+
+// Error recovery
+DEFINE_bool(recover, false, "Reset and reconnect a QP after a bad completion instead of exiting");
+DEFINE_int32(max_recoveries, 16, "Isolate a QP after this many failed recovery attempts in a row");
+
+// Coordinator / agent mode
+DEFINE_string(agents, "", "Coordinator mode: comma separated agent hosts that run the case slices");
+DEFINE_string(server_agent, "", "Agent host that runs the server side, empty if the server is started by hand");
+DEFINE_string(agent_flags, "", "Flags forwarded to every agent, e.g. \"--dev=mlx5_1 --verify\"");
+DEFINE_bool(agent, false, "Agent mode: wait for a job from a coordinator on --agent_port");
+DEFINE_int32(agent_port, 2346, "TCP port agents listen on for the coordinator");
+DEFINE_int32(client_num, 1, "Number of client hosts a server accepts");
+DEFINE_int32(start_delay_ms, 500, "Delay between the start barrier and the synchronized start");
 
 namespace Htn {
 
@@ -62,10 +130,11 @@ int Initialize(int argc, char **argv) {
 
 struct ibv_qp_init_attr MakeQpInitAttr(struct ibv_cq *send_cq,
                                        struct ibv_cq *recv_cq,
-                                       int send_wq_depth, int recv_wq_depth) {
+                                       int send_wq_depth, int recv_wq_depth,
+                                       enum ibv_qp_type qp_type) {
     struct ibv_qp_init_attr qp_init_attr;
     memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-    // qp_init_attr.qp_type = (enum ibv_qp_type)FLAGS_qp_type;
+    qp_init_attr.qp_type = qp_type;
     qp_init_attr.sq_sig_all = 0;
     qp_init_attr.send_cq = send_cq;
     qp_init_attr.recv_cq = recv_cq;
@@ -73,19 +142,19 @@ struct ibv_qp_init_attr MakeQpInitAttr(struct ibv_cq *send_cq,
     qp_init_attr.cap.max_recv_wr = recv_wq_depth;
     // qp_init_attr.cap.max_send_sge = kMaxSge;
     // qp_init_attr.cap.max_recv_sge = kMaxSge;
-    // qp_init_attr.cap.max_inline_data = kMaxInline;
+    qp_init_attr.cap.max_inline_data = FLAGS_max_inline;
     return qp_init_attr;
 }
 
 struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state state, enum ibv_qp_type qp_type,
-                              int remote_qpn, const union ibv_gid &remote_gid,
+                              int port_num, int remote_qpn, const union ibv_gid &remote_gid,
                               int *attr_mask) {
     struct ibv_qp_attr attr;
     memset(&attr, 0, sizeof(attr));
     *attr_mask = 0;
     switch (state) {
         case IBV_QPS_INIT:
-            attr.port_num = 1;
+            attr.port_num = port_num;
             attr.qp_state = IBV_QPS_INIT;
             switch (qp_type) {
                 case IBV_QPT_UD:
@@ -94,11 +163,15 @@ struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state state, enum ibv_qp_type qp_type,
                     break;
                 case IBV_QPT_UC:
                 case IBV_QPT_RC:
+                case IBV_QPT_XRC_RECV:
                     attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE |
                                             IBV_ACCESS_REMOTE_READ |
                                             IBV_ACCESS_REMOTE_ATOMIC;
                     *attr_mask |= IBV_QP_ACCESS_FLAGS;
                     break;
+                case IBV_QPT_XRC_SEND:
+                    // The initiator side of XRC takes no access flags.
+                    break;
                 default:
                     LOG(ERROR) << "Unsupported QP type: " << qp_type;
                 break;
@@ -110,10 +183,12 @@ struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state state, enum ibv_qp_type qp_type,
             *attr_mask |= IBV_QP_STATE;
             switch (qp_type) {
                 case IBV_QPT_RC:
+                case IBV_QPT_XRC_RECV:
                     attr.max_dest_rd_atomic = FLAGS_max_qp_rd_atom;
                     attr.min_rnr_timer = FLAGS_min_rnr_timer;
                     *attr_mask |= IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
                 case IBV_QPT_UC:
+                case IBV_QPT_XRC_SEND:
                     attr.path_mtu = (enum ibv_mtu)FLAGS_mtu;
                     attr.dest_qp_num = remote_qpn;
                     attr.rq_psn = 0;
@@ -124,9 +199,9 @@ struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state state, enum ibv_qp_type qp_type,
                     attr.ah_attr.grh.traffic_class = FLAGS_tos;
                     memcpy(&attr.ah_attr.grh.dgid, &remote_gid, 16);
                     attr.ah_attr.dlid = 0;
-                    attr.ah_attr.sl = 0;
+                    attr.ah_attr.sl = FLAGS_sl;
                     attr.ah_attr.src_path_bits = 0;
-                    attr.ah_attr.port_num = 1;
+                    attr.ah_attr.port_num = port_num;
                     *attr_mask |=
                         IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN;
                     break;
@@ -139,7 +214,12 @@ struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state state, enum ibv_qp_type qp_type,
             attr.sq_psn = 0;
             *attr_mask |= IBV_QP_STATE | IBV_QP_SQ_PSN;
             switch (qp_type) {
+                case IBV_QPT_XRC_RECV:
+                    attr.timeout = FLAGS_qp_timeout;
+                    *attr_mask |= IBV_QP_TIMEOUT;
+                    break;
                 case IBV_QPT_RC:
+                case IBV_QPT_XRC_SEND:
                     attr.timeout = FLAGS_qp_timeout;
                     attr.retry_cnt = FLAGS_retry_cnt;
                     attr.rnr_retry = FLAGS_rnr_retry;  // This is the retry counter, 7
@@ -158,6 +238,108 @@ struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state state, enum ibv_qp_type qp_type,
     return attr;
 }
 
+static bool ParseInt(const std::string &str, int *value) {
+    char *end = nullptr;
+    long v = strtol(str.c_str(), &end, 0);
+    if (str.empty() || *end != '\0') {
+        return false;
+    }
+    *value = (int)v;
+    return true;
+}
+
+// Parse one line of the test case file:
+// service_type write_num read_num send_recv_num mr_num sg_num data_size
+// [write_imm_num send_imm_num] [key=value ...]
+int ParseTestQp(const std::string &line, test_qp *test) {
+    int *columns[] = {&test->service_type, &test->write_num, &test->read_num,
+                      &test->send_recv_num, &test->mr_num, &test->sg_num,
+                      &test->data_size, &test->write_imm_num, &test->send_imm_num};
+    const int column_num = sizeof(columns) / sizeof(columns[0]);
+    const int required_num = 7;
+    std::stringstream line_stream(line);
+    std::string token;
+    int col = 0;
+    while (line_stream >> token) {
+        auto eq = token.find('=');
+        if (eq == std::string::npos) {
+            if (col == column_num || !ParseInt(token, columns[col])) {
+                LOG(ERROR) << "Bad test case column " << col << ": " << token;
+                return -1;
+            }
+            col++;
+            continue;
+        }
+        auto key = token.substr(0, eq);
+        auto value = token.substr(eq + 1);
+        if (key == "addr") {
+            test->addr = ParseAddrPattern(value);
+            if (test->addr < 0) {
+                LOG(ERROR) << "Unknown address pattern: " << token;
+                return -1;
+            }
+            continue;
+        }
+        if (key == "align") {
+            test->align = ParseAlignClass(value);
+            if (test->align < 0) {
+                LOG(ERROR) << "Unknown alignment class: " << token;
+                return -1;
+            }
+            continue;
+        }
+        int *field = nullptr;
+        if (key == "group") {
+            field = &test->group;
+        } else if (key == "rd_atomic") {
+            field = &test->rd_atomic;
+        } else if (key == "dest_rd_atomic") {
+            field = &test->dest_rd_atomic;
+        } else if (key == "tc") {
+            field = &test->tc;
+        } else if (key == "sl") {
+            field = &test->sl;
+        } else if (key == "prio") {
+            field = &test->prio;
+        } else if (key == "stride") {
+            field = &test->stride;
+        } else if (key == "offset") {
+            field = &test->offset;
+        }
+        if (!field || !ParseInt(value, field)) {
+            LOG(ERROR) << "Bad test case option: " << token;
+            return -1;
+        }
+    }
+    if (col < required_num) {
+        LOG(ERROR) << "Test case needs at least " << required_num << " columns: " << line;
+        return -1;
+    }
+    if (test->group < 0) {
+        LOG(ERROR) << "Test case group must not be negative: " << line;
+        return -1;
+    }
+    if (test->rd_atomic < 0 || test->rd_atomic > 255 ||
+        test->dest_rd_atomic < 0 || test->dest_rd_atomic > 255) {
+        LOG(ERROR) << "Test case rd_atomic/dest_rd_atomic out of range: " << line;
+        return -1;
+    }
+    if (test->tc < -1 || test->tc > 255 || test->sl < -1 || test->sl > 15 ||
+        test->prio < -1 || test->prio > 15) {
+        LOG(ERROR) << "Test case tc/sl/prio out of range: " << line;
+        return -1;
+    }
+    if (test->stride < 0 || test->offset < -1) {
+        LOG(ERROR) << "Test case stride/offset must not be negative: " << line;
+        return -1;
+    }
+    if (test->offset >= (int)kPageBytes) {
+        LOG(ERROR) << "Test case offset must be below " << kPageBytes << ": " << line;
+        return -1;
+    }
+    return 0;
+}
+
 std::vector<std::string> ParseHost(std::string host_ip) {
     std::vector<std::string> result;
     std::stringstream s_stream(host_ip);
@@ -169,6 +351,40 @@ std::vector<std::string> ParseHost(std::string host_ip) {
     return result;
 }
 
+int TcpConnect(const char *server, int port) {
+    struct addrinfo *res, *t;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char *service;
+    int n;
+    int sockfd = -1;
+    int err;
+    if (asprintf(&service, "%d", port) < 0) return -1;
+    n = getaddrinfo(server, service, &hints, &res);
+    if (n < 0) {
+        LOG(ERROR) << gai_strerror(n) << " for " << server << ":" << port;
+        free(service);
+        return -1;
+    }
+    for (t = res; t; t = t->ai_next) {
+        sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
+        if (sockfd >= 0) {
+            if (!connect(sockfd, t->ai_addr, t->ai_addrlen)) break;
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    free(service);
+    if (sockfd < 0) {
+        LOG(ERROR) << "Couldn't connect to " << server << ":" << port;
+        return -1;
+    }
+    return sockfd;
+}
+
 // get current time in microsecond
 uint64_t Now64() {
     struct timespec tv;
@@ -14,6 +14,7 @@
 
 #include <infiniband/mlx5dv.h>
 #include <infiniband/verbs.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 // #include <stdlib>
@@ -37,13 +38,85 @@ DECLARE_string(traffic);
 
 DECLARE_int32(cq_sharing_num);
 DECLARE_int32(mr_num_per_qp);
+DECLARE_int32(mr_reg_threads);
+DECLARE_int32(mr_churn_num);
+DECLARE_int32(mr_churn_rate);
+DECLARE_int32(qp_churn_threads);
+DECLARE_int32(qp_churn_rate);
+DECLARE_string(pd_mode);
+DECLARE_int32(pd_num);
 
 // Resource Management
 DECLARE_int32(buf_size);
 DECLARE_int32(buf_num);
+DECLARE_string(addr_pattern);
+DECLARE_int32(addr_stride);
+DECLARE_int32(addr_ring);
+DECLARE_double(zipf_theta);
+DECLARE_string(local_align);
+DECLARE_int32(local_offset);
 DECLARE_int32(cq_depth);
+DECLARE_string(cq_mode);
+DECLARE_int32(hybrid_spin_us);
+DECLARE_int32(cq_poll_budget);
+DECLARE_int32(post_coalesce_us);
+DECLARE_int32(max_inline);
+DECLARE_bool(split_reads);
+DECLARE_int32(max_qp_rd_atom);
+DECLARE_int32(min_rnr_timer);
+DECLARE_int32(hop_limit);
+DECLARE_int32(tos);
+DECLARE_int32(sl);
+DECLARE_int32(qp_timeout);
+DECLARE_int32(retry_cnt);
+DECLARE_int32(rnr_retry);
+DECLARE_int32(mtu);
+DECLARE_int32(dci_num);
+DECLARE_string(dci_policy);
+DECLARE_int32(dc_flow_depth);
 DECLARE_int32(send_wq_depth);
 DECLARE_int32(recv_wq_depth);
+DECLARE_string(recv_topology);
+DECLARE_int32(srq_depth);
+
+// Run control
+DECLARE_int32(warmup);
+DECLARE_int32(duration);
+DECLARE_int32(stats_interval_ms);
+DECLARE_double(steady_cv);
+DECLARE_int32(steady_window);
+DECLARE_int32(steady_timeout);
+DECLARE_string(hw_counters);
+DECLARE_bool(cc_stats);
+DECLARE_string(cc_counters);
+DECLARE_string(cc_ethtool);
+DECLARE_string(cc_profile);
+DECLARE_int32(fair_interval_ms);
+DECLARE_int32(starve_share);
+DECLARE_int32(starve_ms);
+DECLARE_string(results);
+DECLARE_int64(results_records);
+
+// On-demand paging
+DECLARE_bool(odp);
+DECLARE_bool(odp_implicit);
+DECLARE_bool(odp_prefetch);
+
+// Data verification
+DECLARE_bool(verify);
+
+// Error recovery
+DECLARE_bool(recover);
+DECLARE_int32(max_recoveries);
+
+// Coordinator / agent mode
+DECLARE_string(agents);
+DECLARE_string(server_agent);
+DECLARE_string(agent_flags);
+DECLARE_bool(agent);
+DECLARE_int32(agent_port);
+DECLARE_int32(client_num);
+DECLARE_int32(start_delay_ms);
 
 namespace Htn {
 
@@ -51,9 +124,34 @@ constexpr int kHostInfoKey = 0;
 constexpr int kMemInfoKey = 1;
 constexpr int kChannelInfoKey = 2;
 constexpr int kGoGoKey = 3;
+constexpr int kRecoverKey = 4;
 constexpr int kMaxConnRetry = 10;
 constexpr int kMaxBatch = 128;
 constexpr int kCqPollDepth = 128;
+constexpr uint64_t kPostSweepUs = 1000;  // full endpoint sweep of the client loop
+constexpr int kRecvRepostBatch = 32;
+constexpr uint64_t kVerifyLogLimit = 16;
+constexpr uint64_t kErrorLogLimit = 16;
+constexpr int kWcStatusNum = 32;  // covers every enum ibv_wc_status value
+// service_type of DC case lines, see htn_dc.hh
+constexpr int kQptDc = IBV_QPT_DRIVER;
+constexpr uint64_t kDcAccessKey = 0x48544e4443ull;
+
+// Immediate data of *_WITH_IMM requests: the high 16 bits carry a per-QP
+// sequence number and the low 16 bits the sender's clock in microseconds
+// (mod 2^16). One-way latency is only meaningful between synced hosts and
+// aliases beyond 65 ms.
+constexpr int kImmSeqShift = 16;
+constexpr uint32_t kImmSeqMask = 0xffff;
+constexpr uint32_t kImmTsMask = 0xffff;
+
+inline uint32_t MakeImm(uint32_t seq, uint64_t now_us) {
+    return ((seq & kImmSeqMask) << kImmSeqShift) | (now_us & kImmTsMask);
+}
+inline uint32_t ImmSeq(uint32_t imm) { return imm >> kImmSeqShift; }
+inline uint32_t ImmLatency(uint32_t imm, uint64_t now_us) {
+    return (uint16_t)((now_us & kImmTsMask) - (imm & kImmTsMask));
+}
 
 class connect_info {
 public:
@@ -74,6 +172,13 @@ public:
             int qp_num;  // QP number. For connection setup
             uint16_t dlid;
             uint8_t sl;
+            union ibv_gid gid;  // gid of the device the QP lives on
+            uint64_t remote_addr;  // buffer registered on that device
+            uint32_t remote_K;
+            int size;
+            uint32_t psn;  // starting PSN of the sender's QP, for recovery
+            uint32_t srqn;  // XRC SRQ the sender targets, --recv_topology=xrc
+            uint64_t span;  // registered bytes from remote_addr on, see --addr_pattern
         } channel;
     } info;
 };
@@ -86,19 +191,40 @@ struct test_qp {
     int mr_num;
     int sg_num;
     int data_size;
+    // optional trailing columns
+    int write_imm_num = 0;
+    int send_imm_num = 0;
+    // key=value options
+    int group = 0;  // tenant group, see --pd_mode=group
+    int rd_atomic = 0;       // max_rd_atomic, 0 for --max_qp_rd_atom
+    int dest_rd_atomic = 0;  // max_dest_rd_atomic, 0 for --max_qp_rd_atom
+    int tc = -1;    // GRH traffic class, -1 for --tos
+    int sl = -1;    // service level, -1 for --sl
+    int prio = -1;  // expected priority, -1 for sl if given, else the DSCP's top bits (tc >> 5)
+    int addr = -1;    // remote address pattern (htn_addr_pattern), -1 for --addr_pattern
+    int stride = 0;   // slot distance of the pattern, 0 for --addr_stride
+    int align = -1;   // local placement (htn_align_class), -1 for --local_align
+    int offset = -1;  // misalignment of align=offset, -1 for --local_offset
 };
 
+int ParseTestQp(const std::string &line, test_qp *test);
+
 int Initialize(int argc, char **argv);
-struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state, enum ibv_qp_type,
+struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state, enum ibv_qp_type, int port_num,
                               int remote_qpn, const union ibv_gid &remote_gid,
                               int *attr_mask);
 
 std::vector<std::string> ParseHost(std::string host_ip);
 struct ibv_qp_init_attr MakeQpInitAttr(struct ibv_cq *send_cq,
                                        struct ibv_cq *recv_cq,
-                                       int send_wq_depth, int recv_wq_depth);
-}
+                                       int send_wq_depth, int recv_wq_depth,
+                                       enum ibv_qp_type qp_type);
+
+// TCP connection to server:port, -1 on failure
+int TcpConnect(const char *server, int port);
 
 uint64_t Now64();
 uint64_t Now64Ns();
+}
+
 #endif
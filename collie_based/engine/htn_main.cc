@@ -8,16 +8,24 @@
 #include <thread>
 // #include <string>
 #include "htn_context.hh"
+#include "htn_coord.hh"
 
 int main(int argc, char **argv) {
     if (Htn::Initialize(argc, argv)) {
         return -1;
     }
+    if (FLAGS_agent) {
+        return Htn::RunAgent();
+    }
+    if (!FLAGS_agents.empty()) {
+        return Htn::RunCoordinator();
+    }
     std::thread listen_thread;
     std::thread server_thread;
     
     if (FLAGS_server) { // server branch
         Htn::htn_context* server_context = new Htn::htn_context();
+        server_context->num_of_hosts_ = FLAGS_client_num;
         LOG(INFO) << "enter server!";
         if (server_context->Init()) {
             LOG(ERROR) << "Server initialization failed!";
@@ -35,6 +43,7 @@ int main(int argc, char **argv) {
         std::vector<std::string> host_list = Htn::ParseHost(FLAGS_connect_ip);
         LOG(INFO) << "parse host finish!";
         Htn::htn_context* client_context = new Htn::htn_context();
+        client_context->num_of_hosts_ = host_list.size();
         if (client_context->Init()) {
             LOG(ERROR) << "Client initialization failed!";
             return -1;
@@ -49,7 +58,11 @@ int main(int argc, char **argv) {
         LOG(INFO) << "client connect finish!";
         client_context->ClientLaunch();
     }
-    listen_thread.join();
-    server_thread.join();
+    if (listen_thread.joinable()) {
+        listen_thread.join();
+    }
+    if (server_thread.joinable()) {
+        server_thread.join();
+    }
     return 0;
 }
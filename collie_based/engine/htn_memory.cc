@@ -8,13 +8,38 @@
 #include "htn_memory.hh"
 
 #include <malloc.h>
+#include <map>
+#include <mutex>
 
 namespace Htn {
 
-int htn_region::Mallocate() {
-    auto buf_size = num_ * size_;
+// Implicit ODP MRs cover the whole address space, one per PD is enough.
+static std::map<struct ibv_pd *, struct ibv_mr *> implicit_mrs;
+static std::mutex implicit_lock;
+
+static int RegionAccessFlags() {
     int mrflags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
                     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
+    if (FLAGS_odp || FLAGS_odp_implicit) {
+        mrflags |= IBV_ACCESS_ON_DEMAND;
+    }
+    return mrflags;
+}
+
+static struct ibv_mr *ImplicitMr(struct ibv_pd *pd) {
+    std::lock_guard<std::mutex> guard(implicit_lock);
+    auto &mr = implicit_mrs[pd];
+    if (!mr) {
+        mr = ibv_reg_mr(pd, nullptr, SIZE_MAX, RegionAccessFlags());
+        if (!mr) {
+            PLOG(ERROR) << "ibv_reg_mr() of implicit ODP MR failed";
+        }
+    }
+    return mr;
+}
+
+int htn_region::Mallocate() {
+    auto buf_size = num_ * size_;
     char *buffer = nullptr;
 
     if (align_) {
@@ -27,9 +52,8 @@ int htn_region::Mallocate() {
         PLOG(ERROR) << "Memory Allocation Failed";
         return -1;
     }
-    mr_ = ibv_reg_mr(pd_, buffer, buf_size, mrflags);
-    if (!mr_) {
-        PLOG(ERROR) << "ibv_reg_mr() failed";
+    addr_ = buffer;
+    if (Register()) {
         return -1;
     }
     for (size_t i = 0; i < num_; i++) {
@@ -40,6 +64,58 @@ int htn_region::Mallocate() {
     return 0;
 }
 
+int htn_region::Register() {
+    auto start = Now64Ns();
+    if (FLAGS_odp_implicit) {
+        mr_ = ImplicitMr(pd_);
+    } else {
+        mr_ = ibv_reg_mr(pd_, addr_, (size_t)num_ * size_, RegionAccessFlags());
+    }
+    reg_ns_ = Now64Ns() - start;
+    if (!mr_) {
+        PLOG(ERROR) << "ibv_reg_mr() failed";
+        return -1;
+    }
+    if ((FLAGS_odp || FLAGS_odp_implicit) && FLAGS_odp_prefetch) {
+        struct ibv_sge sge;
+        sge.addr = (uint64_t)addr_;
+        sge.length = (uint32_t)num_ * size_;
+        sge.lkey = mr_->lkey;
+        start = Now64Ns();
+        // FLUSH makes the call return only after the pages are mapped.
+        if (ibv_advise_mr(pd_, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE,
+                          IBV_ADVISE_MR_FLAG_FLUSH, &sge, 1)) {
+            PLOG(ERROR) << "ibv_advise_mr() failed";
+            return -1;
+        }
+        prefetch_ns_ = Now64Ns() - start;
+    }
+    return 0;
+}
+
+int htn_region::Deregister() {
+    if (FLAGS_odp_implicit) {
+        mr_ = nullptr;
+        return 0;
+    }
+    if (mr_ && ibv_dereg_mr(mr_)) {
+        PLOG(ERROR) << "ibv_dereg_mr() failed";
+        return -1;
+    }
+    mr_ = nullptr;
+    return 0;
+}
+
+void htn_region::Free() {
+    while (!buffers_.empty()) {
+        delete buffers_.front();
+        buffers_.pop();
+    }
+    Deregister();
+    free(addr_);
+    addr_ = nullptr;
+}
+
 htn_buffer *htn_region::GetBuffer() {
     if (buffers_.empty()) {
         LOG(ERROR) << "The MR's buffer is empty";
@@ -51,4 +127,60 @@ htn_buffer *htn_region::GetBuffer() {
     return rbuf;
 }
 
-}
\ No newline at end of file
+// Make sure the device can serve the requested ODP mode on RC.
+int CheckOdpCaps(struct ibv_context *ctx) {
+    if (!FLAGS_odp && !FLAGS_odp_implicit) {
+        return 0;
+    }
+    struct ibv_device_attr_ex attr;
+    memset(&attr, 0, sizeof(attr));
+    if (ibv_query_device_ex(ctx, nullptr, &attr)) {
+        PLOG(ERROR) << "ibv_query_device_ex() failed";
+        return -1;
+    }
+    if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT)) {
+        LOG(ERROR) << "Device does not support ODP";
+        return -1;
+    }
+    if (FLAGS_odp_implicit && !(attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT)) {
+        LOG(ERROR) << "Device does not support implicit ODP";
+        return -1;
+    }
+    uint32_t rc_need = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV |
+                       IBV_ODP_SUPPORT_WRITE | IBV_ODP_SUPPORT_READ;
+    if ((attr.odp_caps.per_transport_caps.rc_odp_caps & rc_need) != rc_need) {
+        LOG(WARNING) << "RC ODP caps 0x" << std::hex
+                << attr.odp_caps.per_transport_caps.rc_odp_caps << std::dec
+                << " lack some of SEND/RECV/WRITE/READ";
+    }
+    return 0;
+}
+
+// The kernel exposes per-MR ODP statistics through rdma netlink; iproute2
+// prints them as "page_faults N page_invalidations N page_prefetch N".
+int ReadOdpCounters(const std::string &dev, odp_counters *counters) {
+    std::string cmd = "rdma statistic mr show dev " + dev + " 2>/dev/null";
+    FILE *fp = popen(cmd.c_str(), "r");
+    if (!fp) {
+        return -1;
+    }
+    *counters = odp_counters();
+    char token[64];
+    unsigned long long value;
+    while (fscanf(fp, "%63s", token) == 1) {
+        uint64_t *field = nullptr;
+        if (!strcmp(token, "page_faults")) {
+            field = &counters->faults;
+        } else if (!strcmp(token, "page_invalidations")) {
+            field = &counters->invalidations;
+        } else if (!strcmp(token, "page_prefetch")) {
+            field = &counters->prefetched;
+        }
+        if (field && fscanf(fp, "%llu", &value) == 1) {
+            *field += value;
+        }
+    }
+    return pclose(fp) == 0 ? 0 : -1;
+}
+
+}
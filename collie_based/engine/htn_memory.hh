@@ -29,10 +29,13 @@ class htn_region {
 public:
     struct ibv_mr *mr_ = nullptr;
     struct ibv_pd *pd_ = nullptr;
+    char *addr_ = nullptr;
     int numa_ = -1;
     int num_ = 0; // number of HTN buffers
     uint32_t size_ = 0;
     bool align_ = false;
+    uint64_t reg_ns_ = 0;  // latency of the last ibv_reg_mr
+    uint64_t prefetch_ns_ = 0;  // latency of the last ibv_advise_mr
     std::queue<htn_buffer *> buffers_;
 
     htn_region(struct ibv_pd *pd, size_t size, int n, bool align, int numa)
@@ -40,10 +43,25 @@ public:
 
     // Allocate from main memory
     int Mallocate();
+    // (Re-)register the allocated buffer, used by MR churn
+    int Register();
+    int Deregister();
+    // Deregister and release the memory and its buffers
+    void Free();
     // Pick a buffer in the order of FIFO
     htn_buffer *GetBuffer();
 };
 
+// ODP page fault statistics of a device, summed over all its MRs
+struct odp_counters {
+    uint64_t faults = 0;
+    uint64_t invalidations = 0;
+    uint64_t prefetched = 0;
+};
+
+int CheckOdpCaps(struct ibv_context *ctx);
+int ReadOdpCounters(const std::string &dev, odp_counters *counters);
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,147 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "htn_pattern.hh"
+
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <random>
+#include <unordered_set>
+
+namespace Htn {
+
+static const char *kAddrPatternNames[] = {"fixed", "seq", "rand", "zipf", "page"};
+
+int ParseAddrPattern(const std::string &name) {
+    for (int i = 0; i < sizeof(kAddrPatternNames) / sizeof(kAddrPatternNames[0]); i++) {
+        if (name == kAddrPatternNames[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *AddrPatternName(int pattern) { return kAddrPatternNames[pattern]; }
+
+static const char *kAlignClassNames[] = {"base", "page", "offset", "rand", "cross4k", "cross2m"};
+
+int ParseAlignClass(const std::string &name) {
+    for (int i = 0; i < sizeof(kAlignClassNames) / sizeof(kAlignClassNames[0]); i++) {
+        if (name == kAlignClassNames[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *AlignClassName(int align) { return kAlignClassNames[align]; }
+
+static uint64_t RoundUp(uint64_t v, uint64_t unit) { return (v + unit - 1) / unit * unit; }
+
+int64_t AlignOffset(int align, uint64_t addr, uint64_t span, uint32_t size, uint32_t misalign) {
+    uint64_t start = addr;
+    switch (align) {
+        case kAlignPage:
+            start = RoundUp(addr, kPageBytes);
+            break;
+        case kAlignOffset:
+            start = RoundUp(addr, kPageBytes) + misalign;
+            break;
+        case kAlignCross4k:
+            // Half of the message on each side of the boundary
+            start = RoundUp(addr + size / 2 + 1, kPageBytes) - size / 2;
+            break;
+        case kAlignCross2m:
+            start = RoundUp(addr + size / 2 + 1, kHugePageBytes) - size / 2;
+            break;
+    }
+    return start + size <= addr + span ? (int64_t)(start - addr) : -1;
+}
+
+// Zeta(n, theta) is a sum over all n items; endpoints of a run share n.
+static double Zeta(uint64_t n, double theta) {
+    static std::mutex lock;
+    static std::map<std::pair<uint64_t, double>, double> cache;
+    std::lock_guard<std::mutex> guard(lock);
+    auto &zeta = cache[{n, theta}];
+    if (zeta == 0) {
+        for (uint64_t i = 1; i <= n; i++) {
+            zeta += 1.0 / std::pow((double)i, theta);
+        }
+    }
+    return zeta;
+}
+
+void htn_addr_ring::Init(int pattern, uint64_t span, uint32_t size, uint32_t stride,
+                         uint32_t entries, uint64_t seed) {
+    pattern_ = pattern;
+    stride_ = std::max(stride, 1u);
+    last_ = span > size ? span - size : 0;
+    seq_ = 0;
+    ring_.clear();
+    if (pattern == kAddrFixed || pattern == kAddrSeq) {
+        return;
+    }
+    uint32_t n = 1;
+    while (n < entries) {
+        n <<= 1;
+    }
+    ring_.resize(n);
+    mask_ = n - 1;
+    idx_ = 0;
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    uint64_t slots = last_ / stride_ + 1;
+    // Gray et al.'s generator, as in YCSB. Item ranks are scattered over
+    // the slots so that the hot set is not one contiguous range.
+    double theta = FLAGS_zipf_theta;
+    double zetan = 0, alpha = 0, eta = 0;
+    if (pattern == kAddrZipf) {
+        zetan = Zeta(slots, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1 - std::pow(2.0 / slots, 1 - theta)) / (1 - Zeta(2, theta) / zetan);
+    }
+    uint64_t pages = span / kPageBytes;
+    for (auto &offset : ring_) {
+        switch (pattern) {
+            case kAddrRand:
+                offset = (rng() % slots) * stride_;
+                break;
+            case kAddrZipf: {
+                double u = uniform(rng);
+                double uz = u * zetan;
+                uint64_t rank = uz < 1 ? 0 : uz < 1 + std::pow(0.5, theta) ? 1
+                              : (uint64_t)(slots * std::pow(eta * u - eta + 1, alpha));
+                offset = (rank * 0x9e3779b97f4a7c15ull % slots) * stride_;
+                break;
+            }
+            case kAddrPage: {
+                // Half of the message on each side of the boundary
+                uint64_t boundary = pages > 1 ? (1 + rng() % (pages - 1)) * kPageBytes : 0;
+                offset = std::min(boundary > size / 2 ? boundary - size / 2 : 0, last_);
+                break;
+            }
+        }
+    }
+}
+
+uint64_t htn_addr_ring::Pages() const {
+    if (pattern_ == kAddrFixed) {
+        return 1;
+    }
+    if (pattern_ == kAddrSeq) {
+        return last_ / kPageBytes + 1;
+    }
+    std::unordered_set<uint64_t> pages;
+    for (auto offset : ring_) {
+        pages.insert(offset / kPageBytes);
+    }
+    return pages.size();
+}
+
+}
@@ -0,0 +1,84 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+// Remote address patterns (--addr_pattern, case option addr=). A WRITE or
+// READ lands at an offset into the span the peer registered for the
+// channel. Offsets other than sequential ones are drawn ahead of time into
+// a per-endpoint ring, so the post path only loads the next entry.
+
+#ifndef HTN_PATTERN_HH
+#define HTN_PATTERN_HH
+
+#include <string>
+#include <vector>
+
+#include "htn_helper.hh"
+
+namespace Htn {
+
+enum htn_addr_pattern {
+    kAddrFixed = 0,  // every request at offset 0
+    kAddrSeq,        // stride by stride over the span, then wrap
+    kAddrRand,       // uniform over the stride-aligned slots of the span
+    kAddrZipf,       // Zipfian (--zipf_theta) over the slots, hot slots scattered
+    kAddrPage,       // straddle a random 4 KB page boundary
+};
+
+constexpr uint64_t kPageBytes = 4096;
+constexpr uint64_t kHugePageBytes = 2 << 20;
+
+int ParseAddrPattern(const std::string &name);
+const char *AddrPatternName(int pattern);
+
+// Placement of a message in its local buffer (--local_align, case option
+// align=). Classes are defined on absolute addresses, whatever alignment the
+// allocator gave the region.
+enum htn_align_class {
+    kAlignBase = 0,  // the buffer base as allocated
+    kAlignPage,      // a 4 KB boundary
+    kAlignOffset,    // offset= bytes past a 4 KB boundary
+    kAlignRand,      // any byte of the region
+    kAlignCross4k,   // straddle a 4 KB boundary
+    kAlignCross2m,   // straddle a 2 MB boundary
+};
+
+int ParseAlignClass(const std::string &name);
+const char *AlignClassName(int align);
+// Offset from `addr` where a message of `size` bytes of class `align` (not
+// rand) starts, -1 if `span` bytes from `addr` on cannot hold it
+int64_t AlignOffset(int align, uint64_t addr, uint64_t span, uint32_t size, uint32_t misalign);
+
+class htn_addr_ring {
+public:
+    // Offsets of messages of `size` bytes in `span` bytes, slots `stride`
+    // bytes apart. `seed` makes the sequence of a run reproducible.
+    void Init(int pattern, uint64_t span, uint32_t size, uint32_t stride,
+              uint32_t entries, uint64_t seed);
+    uint64_t Next() {
+        if (pattern_ == kAddrSeq) {
+            auto offset = seq_;
+            seq_ = seq_ + stride_ > last_ ? 0 : seq_ + stride_;
+            return offset;
+        }
+        return ring_[idx_++ & mask_];
+    }
+    // Distinct 4 KB pages the pattern touches
+    uint64_t Pages() const;
+    int pattern_ = kAddrFixed;
+
+private:
+    std::vector<uint64_t> ring_;
+    uint32_t mask_ = 0;
+    uint32_t idx_ = 0;
+    uint64_t seq_ = 0;
+    uint64_t stride_ = 0;
+    uint64_t last_ = 0;  // highest offset a message may start at
+};
+
+}
+
+#endif
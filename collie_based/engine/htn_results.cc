@@ -0,0 +1,69 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "htn_results.hh"
+#include "htn_helper.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Htn {
+
+htn_results_log::~htn_results_log() {
+    if (header_) {
+        munmap(header_, size_);
+    }
+}
+
+int htn_results_log::Open(const std::string &path, const std::string &dev,
+                          const std::vector<results_qp> &qps, uint64_t capacity,
+                          uint64_t interval_us, uint64_t start_ts) {
+    size_t meta = sizeof(results_header) + qps.size() * sizeof(results_qp);
+    // Records start 8-byte aligned after the QP table.
+    meta = (meta + 7) & ~(size_t)7;
+    size_ = meta + capacity * sizeof(results_record);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Cannot create results file " << path;
+        return -1;
+    }
+    // Reserve the blocks now, a later write fault must not hit the allocator.
+    if (posix_fallocate(fd, 0, size_)) {
+        LOG(ERROR) << "Cannot preallocate " << size_ << " bytes for " << path;
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        PLOG(ERROR) << "Cannot map results file " << path;
+        return -1;
+    }
+    header_ = (results_header *)base;
+    qps_ = (results_qp *)(header_ + 1);
+    ring_ = (results_record *)((char *)base + meta);
+    memset(header_, 0, sizeof(results_header));
+    header_->magic = kResultsMagic;
+    header_->version = kResultsVersion;
+    header_->header_size = sizeof(results_header);
+    header_->record_size = sizeof(results_record);
+    header_->qp_num = qps.size();
+    header_->start_ts = start_ts;
+    header_->interval_us = interval_us;
+    header_->capacity = capacity;
+    gethostname(header_->host, sizeof(header_->host) - 1);
+    strncpy(header_->dev, dev.c_str(), sizeof(header_->dev) - 1);
+    for (int i = 0; i < qps.size(); i++) {
+        qps_[i] = qps[i];
+    }
+    LOG(INFO) << "Results log " << path << ": " << qps.size() << " QPs, "
+            << capacity << " records";
+    return 0;
+}
+
+}
@@ -0,0 +1,95 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+// Binary results log (--results): a header with the case of every QP followed
+// by a ring of fixed-size per-interval per-QP records. The file is
+// preallocated and mapped, a sample is a plain store into the mapping.
+// Kept free of verbs/glog so that htn_analyzer builds without them.
+
+#ifndef HTN_RESULTS_HH
+#define HTN_RESULTS_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Htn {
+
+constexpr uint32_t kResultsMagic = 0x524e5448;  // "HTNR"
+constexpr uint32_t kResultsVersion = 1;
+
+struct results_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;  // sizeof(results_header)
+    uint32_t record_size;  // sizeof(results_record)
+    uint32_t qp_num;       // results_qp entries after the header
+    uint32_t reserved;
+    uint64_t start_ts;     // us
+    uint64_t interval_us;
+    uint64_t capacity;     // records the ring holds
+    uint64_t head;         // records written so far, the ring wraps
+    char host[64];
+    char dev[64];
+};
+
+// Case of one QP, see test_qp
+struct results_qp {
+    uint32_t id;
+    int32_t service_type;
+    int32_t write_num;
+    int32_t read_num;
+    int32_t send_recv_num;
+    int32_t write_imm_num;
+    int32_t send_imm_num;
+    int32_t mr_num;
+    int32_t sg_num;
+    int32_t data_size;
+    int32_t group;
+    int32_t port_num;
+};
+
+struct results_record {
+    uint64_t timestamp;  // end of the interval, us
+    uint32_t qp;         // results_qp::id
+    uint16_t phase;      // htn_phase
+    uint16_t state;      // htn_ep_state at the end of the interval
+    uint32_t duration;   // us
+    uint32_t reserved;
+    uint64_t bytes;      // sent in the interval
+    uint64_t msgs;       // sent in the interval
+    uint64_t recv_bytes;  // received in the interval
+    uint64_t recv_msgs;
+    uint64_t errors;     // bad completions in the interval
+};
+
+static_assert(sizeof(results_header) == 184, "results_header layout changed");
+static_assert(sizeof(results_qp) == 48, "results_qp layout changed");
+static_assert(sizeof(results_record) == 64, "results_record layout changed");
+
+class htn_results_log {
+public:
+    results_header *header_ = nullptr;
+    results_qp *qps_ = nullptr;
+    results_record *ring_ = nullptr;
+    size_t size_ = 0;
+
+    ~htn_results_log();
+    // Create and map the file, the whole ring is allocated and faulted in.
+    int Open(const std::string &path, const std::string &dev,
+             const std::vector<results_qp> &qps, uint64_t capacity,
+             uint64_t interval_us, uint64_t start_ts);
+    void Append(const results_record &record) {
+        ring_[header_->head % header_->capacity] = record;
+        // Readers of a live file see whole records only.
+        __atomic_store_n(&header_->head, header_->head + 1, __ATOMIC_RELEASE);
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,147 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "htn_srq.hh"
+#include "htn_device.hh"
+
+#include <unistd.h>
+
+namespace Htn {
+
+int ParseRecvTopology(const std::string &name) {
+    if (name == "qp") {
+        return kRecvPerQp;
+    } else if (name == "srq") {
+        return kRecvSrq;
+    } else if (name == "xrc") {
+        return kRecvXrc;
+    }
+    LOG(ERROR) << "Unknown --recv_topology " << name;
+    return -1;
+}
+
+int htn_srq::Init(htn_device *device, struct ibv_pd *pd, struct ibv_xrcd *xrcd, int depth) {
+    depth_ = depth;
+    if (xrcd) {
+        // Completions of the XRC SRQ wake the datapath thread like those of its QPs.
+        cq_ = ibv_create_cq(device->ctx_, depth, nullptr, device->channel_, 0);
+        if (!cq_) {
+            PLOG(ERROR) << "ibv_create_cq() failed for the XRC SRQ of " << device->GetName();
+            return -1;
+        }
+        struct ibv_srq_init_attr_ex attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.attr.max_wr = depth;
+        attr.attr.max_sge = 1;
+        attr.comp_mask = IBV_SRQ_INIT_ATTR_TYPE | IBV_SRQ_INIT_ATTR_PD |
+                         IBV_SRQ_INIT_ATTR_XRCD | IBV_SRQ_INIT_ATTR_CQ;
+        attr.srq_type = IBV_SRQT_XRC;
+        attr.pd = pd;
+        attr.xrcd = xrcd;
+        attr.cq = cq_;
+        srq_ = ibv_create_srq_ex(device->ctx_, &attr);
+        if (srq_ && ibv_get_srq_num(srq_, &srqn_)) {
+            PLOG(ERROR) << "ibv_get_srq_num() failed on " << device->GetName();
+            return -1;
+        }
+    } else {
+        struct ibv_srq_init_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.attr.max_wr = depth;
+        attr.attr.max_sge = 1;
+        srq_ = ibv_create_srq(pd, &attr);
+    }
+    if (!srq_) {
+        PLOG(ERROR) << "Cannot create an SRQ of " << depth << " receives on "
+                << device->GetName();
+        return -1;
+    }
+    // The payload is not consumed, one buffer serves every receive.
+    region_ = new htn_region(pd, FLAGS_buf_size, 1, false, device->numa_);
+    if (region_->Mallocate()) {
+        return -1;
+    }
+    credits_ = depth;
+    while (credits_ > 0) {
+        if (PostRecv(std::min(credits_, (uint32_t)kMaxBatch))) {
+            return -1;
+        }
+    }
+    LOG(INFO) << "dev " << device->GetName() << ": " << (xrcd ? "XRC SRQ " : "SRQ ")
+            << srqn_ << " of " << depth << " receives";
+    return 0;
+}
+
+int htn_srq::PostRecv(uint32_t batch_size) {
+    struct ibv_sge sge[kMaxBatch];
+    struct ibv_recv_wr wr[kMaxBatch];
+    struct ibv_recv_wr *bad_wr;
+    auto buffer = region_->buffers_.front();
+    for (uint32_t i = 0; i < batch_size; i++) {
+        sge[i].addr = buffer->addr_;
+        sge[i].lkey = buffer->local_key_;
+        sge[i].length = buffer->size_;
+        memset(&wr[i], 0, sizeof(struct ibv_recv_wr));
+        wr[i].num_sge = 1;
+        wr[i].sg_list = &sge[i];
+        wr[i].next = (i == batch_size - 1) ? nullptr : &wr[i + 1];
+        wr[i].wr_id = (uint64_t)this | kSrqWrTag;
+    }
+    if (ibv_post_srq_recv(srq_, wr, &bad_wr)) {
+        PLOG(ERROR) << "ibv_post_srq_recv() failed";
+        return -1;
+    }
+    credits_ -= batch_size;
+    return 0;
+}
+
+int htn_srq::Refill() {
+    while (credits_ >= kRecvRepostBatch) {
+        if (PostRecv(std::min(credits_, (uint32_t)kMaxBatch))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct ibv_qp *CreateXrcRecvQp(struct ibv_context *ctx, struct ibv_xrcd *xrcd) {
+    struct ibv_qp_init_attr_ex attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_type = IBV_QPT_XRC_RECV;
+    attr.comp_mask = IBV_QP_INIT_ATTR_XRCD;
+    attr.xrcd = xrcd;
+    return ibv_create_qp_ex(ctx, &attr);
+}
+
+struct ibv_qp *CreateXrcSendQp(struct ibv_context *ctx, struct ibv_pd *pd,
+                               struct ibv_cq *cq, int depth) {
+    struct ibv_qp_init_attr_ex attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_type = IBV_QPT_XRC_SEND;
+    attr.send_cq = cq;
+    attr.recv_cq = cq;
+    attr.cap.max_send_wr = depth;
+    attr.cap.max_send_sge = 1;
+    attr.cap.max_inline_data = FLAGS_max_inline;
+    attr.comp_mask = IBV_QP_INIT_ATTR_PD;
+    attr.pd = pd;
+    return ibv_create_qp_ex(ctx, &attr);
+}
+
+uint64_t ResidentBytes() {
+    FILE *f = fopen("/proc/self/statm", "r");
+    unsigned long size = 0, resident = 0;
+    if (f) {
+        if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+}
@@ -0,0 +1,71 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+// Shared receive topologies (--recv_topology). With "srq" the RC QPs of a
+// server PD take their receives from one SRQ instead of a receive queue of
+// their own; with "xrc" the server creates XRC receive QPs in the device's
+// XRC domain and every client XRC send QP targets the SRQ by number. The
+// receive WQEs and buffers then scale with the SRQs, not the connections.
+
+#ifndef HTN_SRQ_HH
+#define HTN_SRQ_HH
+
+#include <unordered_map>
+
+#include "htn_helper.hh"
+#include "htn_memory.hh"
+
+namespace Htn {
+
+class htn_device;
+class htn_endpoint;
+
+// Low bit of the wr_id of SRQ receives, endpoint wr_ids are aligned
+constexpr uint64_t kSrqWrTag = 1;
+
+enum htn_recv_topology {
+    kRecvPerQp = 0,  // a receive queue per QP
+    kRecvSrq,
+    kRecvXrc,
+};
+
+int ParseRecvTopology(const std::string &name);
+
+class htn_srq {
+public:
+    struct ibv_srq *srq_ = nullptr;
+    struct ibv_cq *cq_ = nullptr;  // XRC: completions of all its senders
+    uint32_t srqn_ = 0;            // XRC: target of the senders' requests
+    uint32_t depth_ = 0;
+    uint32_t credits_ = 0;         // consumed receives not reposted yet
+    htn_region *region_ = nullptr;  // every receive lands in its buffer
+    // Receive completions carry the QP number, not the endpoint
+    std::unordered_map<uint32_t, htn_endpoint *> owners_;
+
+    // An SRQ of `depth` receives in `pd`, filled up. `xrcd` makes it an XRC SRQ.
+    int Init(htn_device *device, struct ibv_pd *pd, struct ibv_xrcd *xrcd, int depth);
+    int PostRecv(uint32_t batch_size);
+    // Repost the consumed receives in batches
+    int Refill();
+    htn_endpoint *Owner(uint32_t qpn) {
+        auto it = owners_.find(qpn);
+        return it == owners_.end() ? nullptr : it->second;
+    }
+};
+
+// Server side XRC receive QP in `xrcd`, it has no CQ or receive queue
+struct ibv_qp *CreateXrcRecvQp(struct ibv_context *ctx, struct ibv_xrcd *xrcd);
+// Client side XRC send QP
+struct ibv_qp *CreateXrcSendQp(struct ibv_context *ctx, struct ibv_pd *pd,
+                               struct ibv_cq *cq, int depth);
+
+// Resident memory of the process in bytes
+uint64_t ResidentBytes();
+
+}
+
+#endif
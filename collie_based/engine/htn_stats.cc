@@ -0,0 +1,88 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "htn_stats.hh"
+
+#include <cmath>
+#include <sstream>
+
+namespace Htn {
+
+void htn_histogram::Merge(const htn_histogram &other) {
+    for (int i = 0; i < kBuckets; i++) {
+        buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    if (other.min_ < min_) min_ = other.min_;
+    if (other.max_ > max_) max_ = other.max_;
+}
+
+void htn_histogram::Reset() {
+    *this = htn_histogram();
+}
+
+uint64_t htn_histogram::Percentile(double p) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * count_);
+    if (rank >= count_) {
+        return max_;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += buckets_[i];
+        if (seen > rank) {
+            return LowerBound(i) < min_ ? min_ : LowerBound(i);
+        }
+    }
+    return max_;
+}
+
+std::string htn_histogram::Summary(uint64_t unit) const {
+    std::stringstream ss;
+    ss << "n=" << count_ << " avg=" << Avg() / unit
+       << " p50=" << Percentile(50) / unit << " p99=" << Percentile(99) / unit
+       << " p999=" << Percentile(99.9) / unit
+       << " max=" << (count_ ? max_ : 0) / unit;
+    return ss.str();
+}
+
+double htn_steady_detector::Mean() const {
+    if (samples_.empty()) {
+        return 0;
+    }
+    double mean = 0;
+    for (auto v : samples_) {
+        mean += v;
+    }
+    return mean / samples_.size();
+}
+
+double htn_steady_detector::Cv() const {
+    double mean = Mean(), var = 0;
+    if (mean == 0) {
+        return 0;
+    }
+    for (auto v : samples_) {
+        var += (v - mean) * (v - mean);
+    }
+    var /= samples_.size();
+    return std::sqrt(var) / mean;
+}
+
+double JainIndex(const std::vector<double> &x) {
+    double sum = 0, sq = 0;
+    for (auto v : x) {
+        sum += v;
+        sq += v * v;
+    }
+    return sq > 0 ? sum * sum / (x.size() * sq) : 1;
+}
+
+}
@@ -0,0 +1,98 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+// Statistics helpers shared by the datapath and the control path benchmarks.
+
+#ifndef HTN_STATS_HH
+#define HTN_STATS_HH
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace Htn {
+
+// Log-linear latency histogram: 16 sub-buckets per power of two, so any
+// percentile is within ~6% of the true value. Not thread safe, keep one per
+// thread and Merge().
+class htn_histogram {
+public:
+    static constexpr int kSubBits = 4;
+    static constexpr int kSub = 1 << kSubBits;
+    static constexpr int kBuckets = (64 - kSubBits + 1) * kSub;
+
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = UINT64_MAX;
+    uint64_t max_ = 0;
+    uint64_t buckets_[kBuckets] = {0};
+
+    void Add(uint64_t v) {
+        buckets_[Index(v)]++;
+        count_++;
+        sum_ += v;
+        if (v < min_) min_ = v;
+        if (v > max_) max_ = v;
+    }
+    void Merge(const htn_histogram &other);
+    void Reset();
+    // p in [0, 100]
+    uint64_t Percentile(double p) const;
+    uint64_t Avg() const { return count_ ? sum_ / count_ : 0; }
+    // "n=.. avg=.. p50=.. p99=.. p999=.. max=.." with values divided by unit
+    std::string Summary(uint64_t unit = 1) const;
+
+    static int Index(uint64_t v) {
+        if (v < kSub) {
+            return (int)v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - kSubBits;
+        return (shift + 1) * kSub + (int)((v >> shift) & (kSub - 1));
+    }
+    static uint64_t LowerBound(int idx) {
+        if (idx < kSub) {
+            return idx;
+        }
+        int shift = idx / kSub - 1;
+        return ((uint64_t)kSub + idx % kSub) << shift;
+    }
+};
+
+// Steady state: the coefficient of variation (stddev / mean) of the last
+// `window` samples is below `threshold`.
+class htn_steady_detector {
+public:
+    int window_;
+    double threshold_;
+    std::deque<double> samples_;
+
+    htn_steady_detector(int window, double threshold)
+        : window_(window), threshold_(threshold) {}
+
+    void Add(double sample) {
+        samples_.push_back(sample);
+        if (samples_.size() > (size_t)window_) {
+            samples_.pop_front();
+        }
+    }
+    double Mean() const;
+    double Cv() const;
+    // A window of zero rates is a dead run, not a steady one
+    bool Steady() const {
+        return samples_.size() == (size_t)window_ && Mean() > 0 && Cv() < threshold_;
+    }
+};
+
+// Jain's fairness index (sum x)^2 / (n * sum x^2): 1 when all shares are
+// equal, 1/n when one takes everything.
+double JainIndex(const std::vector<double> &x);
+
+}
+
+#endif
@@ -0,0 +1,219 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "htn_verify.hh"
+
+#include <algorithm>
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace Htn {
+
+static uint32_t crc_table[256];
+
+static bool InitCrcTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+    return true;
+}
+static bool crc_table_ready = InitCrcTable();
+
+static uint32_t Crc32cSw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Three-way interleaved hardware CRC: independent streams over adjacent
+// blocks hide the 3-cycle latency of crc32, the partial results are merged
+// with precomputed "append N zero bytes" operators (see zlib crc32_combine).
+constexpr size_t kCrcLong = 8192;
+constexpr size_t kCrcShort = 256;
+static uint32_t crc_long[4][256];
+static uint32_t crc_short[4][256];
+
+static uint32_t Gf2MatrixTimes(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void Gf2MatrixSquare(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = Gf2MatrixTimes(mat, mat[n]);
+    }
+}
+
+// Build the table that appends len (a power of two) zero bytes to a crc.
+static void CrcZeros(uint32_t zeros[][256], size_t len) {
+    uint32_t even[32], odd[32];
+    odd[0] = 0x82f63b78;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    Gf2MatrixSquare(even, odd);  // 2 zero bits
+    Gf2MatrixSquare(odd, even);  // 4 zero bits
+    uint32_t *op = odd;
+    do {
+        Gf2MatrixSquare(even, odd);
+        op = even;
+        len >>= 1;
+        if (len == 0) break;
+        Gf2MatrixSquare(odd, even);
+        op = odd;
+        len >>= 1;
+    } while (len);
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = Gf2MatrixTimes(op, n);
+        zeros[1][n] = Gf2MatrixTimes(op, n << 8);
+        zeros[2][n] = Gf2MatrixTimes(op, n << 16);
+        zeros[3][n] = Gf2MatrixTimes(op, n << 24);
+    }
+}
+
+static inline uint32_t CrcShift(uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static bool InitCrcShift() {
+    CrcZeros(crc_long, kCrcLong);
+    CrcZeros(crc_short, kCrcShort);
+    return true;
+}
+static bool crc_shift_ready = InitCrcShift();
+
+template <size_t kBlock>
+__attribute__((target("sse4.2")))
+static inline uint64_t Crc32cHw3(uint64_t c0, const uint8_t *&p, size_t &len,
+                                 uint32_t zeros[][256]) {
+    while (len >= kBlock * 3) {
+        uint64_t c1 = 0, c2 = 0;
+        const uint8_t *end = p + kBlock;
+        do {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + kBlock, 8);
+            memcpy(&w2, p + kBlock * 2, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+            p += 8;
+        } while (p < end);
+        c0 = CrcShift(zeros, (uint32_t)c0) ^ c1;
+        c0 = CrcShift(zeros, (uint32_t)c0) ^ c2;
+        p += kBlock * 2;
+        len -= kBlock * 3;
+    }
+    return c0;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    c = Crc32cHw3<kCrcLong>(c, p, len, crc_long);
+    c = Crc32cHw3<kCrcShort>(c, p, len, crc_short);
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+static bool has_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+
+uint32_t Crc32c(const void *data, size_t len) {
+    auto p = (const uint8_t *)data;
+#if defined(__x86_64__)
+    if (has_sse42) {
+        return ~Crc32cHw(~0u, p, len);
+    }
+#endif
+    return ~Crc32cSw(~0u, p, len);
+}
+
+// splitmix64 finalizer, cheap and good enough to make misplaced data visible
+static inline uint64_t PatternWord(uint32_t qp, uint32_t slot, uint64_t offset) {
+    uint64_t z = ((uint64_t)qp << 40) ^ ((uint64_t)slot << 20) ^ offset;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static void FillPattern(uint8_t *p, size_t len, uint32_t qp, uint32_t slot) {
+    for (size_t off = 0; off < len; off += 8) {
+        uint64_t w = PatternWord(qp, slot, off);
+        memcpy(p + off, &w, std::min(len - off, sizeof(w)));
+    }
+}
+
+void VerifyStamp(void *buf, uint32_t len, uint32_t qp, uint32_t slot) {
+    if (len < sizeof(verify_hdr)) {
+        return;
+    }
+    auto hdr = (verify_hdr *)buf;
+    auto payload = (uint8_t *)buf + sizeof(verify_hdr);
+    auto payload_len = len - sizeof(verify_hdr);
+    FillPattern(payload, payload_len, qp, slot);
+    hdr->magic = kVerifyMagic;
+    hdr->qp = qp;
+    hdr->slot = slot;
+    hdr->seq = 0;
+    hdr->len = len;
+    hdr->crc = Crc32c(payload, payload_len);
+}
+
+int64_t VerifyCheck(const void *buf, uint32_t len) {
+    if (len < sizeof(verify_hdr)) {
+        return -1;
+    }
+    auto hdr = (const verify_hdr *)buf;
+    if (hdr->magic != kVerifyMagic || hdr->len != len) {
+        return 0;
+    }
+    auto payload = (const uint8_t *)buf + sizeof(verify_hdr);
+    auto payload_len = len - sizeof(verify_hdr);
+    if (Crc32c(payload, payload_len) == hdr->crc) {
+        return -1;
+    }
+    // Slow path: regenerate the pattern to locate the damage.
+    for (size_t off = 0; off < payload_len; off += 8) {
+        uint64_t w = PatternWord(hdr->qp, hdr->slot, off);
+        auto n = std::min(payload_len - off, sizeof(w));
+        if (memcmp(payload + off, &w, n)) {
+            for (size_t k = 0; k < n; k++) {
+                if (payload[off + k] != ((uint8_t *)&w)[k]) {
+                    return sizeof(verify_hdr) + off + k;
+                }
+            }
+        }
+    }
+    // Pattern intact, so the crc field itself was hit.
+    return offsetof(verify_hdr, crc);
+}
+
+}
@@ -0,0 +1,45 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+// Data integrity verification. Every stamped message starts with a small
+// header followed by a pattern that is a function of (qp, slot, offset);
+// the header carries the CRC32C of the pattern so the checker does not need
+// to regenerate it unless the CRC mismatches.
+
+#ifndef HTN_VERIFY_HH
+#define HTN_VERIFY_HH
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Htn {
+
+constexpr uint32_t kVerifyMagic = 0x48544e56;  // "HTNV"
+constexpr uint32_t kVerifyAnyQp = UINT32_MAX;
+
+struct verify_hdr {
+    uint32_t magic;
+    uint32_t qp;    // sender QP id, kVerifyAnyQp for server read sources
+    uint32_t slot;  // slot of the sender's ring the message was built in
+    uint32_t seq;   // receive sequence, not covered by crc
+    uint32_t len;   // total length including this header
+    uint32_t crc;   // CRC32C of the payload after this header
+};
+
+// CRC32C, using the SSE4.2 crc32 instruction when the CPU has it.
+uint32_t Crc32c(const void *data, size_t len);
+
+// Fill buf[0, len) with the header and pattern of (qp, slot).
+void VerifyStamp(void *buf, uint32_t len, uint32_t qp, uint32_t slot);
+
+// Check a stamped buffer. Returns -1 if it is intact, otherwise the byte
+// offset of the first corrupted byte.
+int64_t VerifyCheck(const void *buf, uint32_t len);
+
+}
+
+#endif
@@ -11,11 +11,13 @@ SERVER_IP = "192.168.0.23"
 CLIENT_IP = "192.168.0.25"
 dev = "mlx5_0"
 OBJ_DIR = "/work/mazhenlong/rnic_test/collie_based/search"
+WARMUP = 3
+DURATION = 10
 
 def start_test():
     if 1:
         server_parameter = "--server --dev=mlx5_0"
-        client_parameter = "--connect_ip=" + SERVER_IP + " --dev=mlx5_0"
+        client_parameter = "--connect_ip=" + SERVER_IP + " --dev=mlx5_0 --warmup=" + str(WARMUP) + " --duration=" + str(DURATION)
         # launch server
         cmd = "ssh " + user + "@" + SERVER_IP + " ' cd " + OBJ_DIR + " && " + EINGINE_PATH + " " + server_parameter + " > " + OBJ_DIR + "/server_log 2>&1 &'&"
         print(cmd)
@@ -23,13 +25,13 @@ def start_test():
         if (rtn != 0):
             raise Exception("Error for cmd!")
         print("start server!")
-        # launch client
-        cmd = "ssh " + user + "@" + CLIENT_IP + " ' cd " + OBJ_DIR + " && " + EINGINE_PATH + " " + client_parameter + " > " + OBJ_DIR + "/client_log 2>&1 &'&" 
+        # launch client, it exits by itself after the timed run
+        cmd = "ssh " + user + "@" + CLIENT_IP + " ' cd " + OBJ_DIR + " && " + EINGINE_PATH + " " + client_parameter + " > " + OBJ_DIR + "/client_log 2>&1'"
         print(cmd)
         rtn = os.system(cmd)
         if (rtn != 0):
             raise Exception("Error for cmd!")
-        print("start client")
+        print("client finished")
     else:
         cmd = "ssh " + user + "@" + SERVER_IP + " '" + "echo $PATH" + " > " + OBJ_DIR + "/server_log &'&"
         print(cmd)
@@ -86,8 +88,6 @@ def main():
     print("finish writing case file!")
     compile()
     start_test()
-    print("start test!")
-    time.sleep(10)
     stop()
     print("finish test!")
     
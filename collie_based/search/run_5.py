@@ -12,6 +12,8 @@ SERVER_IP = "10.5.200.186"
 CLIENT_IP = "10.5.200.187"
 dev = "mlx5_0"
 OBJ_DIR = "/home/mazhenl/shared/rnic_test/collie_based/search"
+WARMUP = 3
+DURATION = 5
 
 def start_test():
     # launch server
@@ -22,8 +24,8 @@ def start_test():
     if (rtn != 0):
         raise Exception("Error for cmd!")
     # launch client
-    client_parameter = "--connect=10.5.200.186 --dev=mlx5_0"
-    cmd = "ssh " + user + "@" + CLIENT_IP + " '" + EINGINE_PATH + " " + client_parameter + " > " + OBJ_DIR + "/client_log &'&" 
+    client_parameter = "--connect_ip=" + SERVER_IP + " --dev=mlx5_0 --warmup=" + str(WARMUP) + " --duration=" + str(DURATION)
+    cmd = "ssh " + user + "@" + CLIENT_IP + " '" + EINGINE_PATH + " " + client_parameter + " > " + OBJ_DIR + "/client_log 2>&1'"
     print(cmd)
     rtn = os.system(cmd)
     if (rtn != 0):
@@ -71,8 +73,6 @@ def main():
         f.write("2 2 2 2 2 2 2")
     print("finish writing case file!")
     start_test()
-    print("start test!")
-    time.sleep(5)
     stop()
     print("finish test!")
     